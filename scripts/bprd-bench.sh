@@ -0,0 +1,186 @@
+#!/bin/bash
+#
+# Benchmarks for bprd, run as root on the node forwarding the test traffic.
+#
+# release DEST ID [N...]
+#	Send UDP traffic to DEST through commodity DEST,ID and report the
+#	packets per second released and the CPU bprd uses, for a release count
+#	of 1 (one verdict per packet) and each N (batched verdicts).  An iperf3
+#	server must be running on DEST.
+#
+# discipline DEST ID [DISC...]
+#	Send UDP traffic to DEST through commodity DEST,ID while pinging DEST,
+#	and report the median and 90th percentile round trip and the goodput
+#	for each service discipline (default fifo, lifo and hybrid,deadline=50).
+#	The pings are queued with the traffic, so they see its queueing delay.
+#
+# startup [N...]
+#	Start bprd with N commodities (default 10, 100 and 1000) and report how
+#	long it takes until the bprd nftables table holds all N map elements,
+#	checking that both chains queue packets by the map.  Needs nft(8).
+#
+# Set BPRD to the bprd binary (default src/bprd), BPRD_ARGS to options
+# passed on every run (e.g. "-i wlan0 -t 1"), DURATION to the seconds each
+# run lasts (default 10) and RATE to the offered load (default 100M).
+
+BPRD=${BPRD:-src/bprd}
+DURATION=${DURATION:-10}
+RATE=${RATE:-100M}
+PIDFILE=/tmp/bprd-bench.pid
+
+die()
+{
+	echo "$0: $*" >&2
+	exit 1
+}
+
+# start bprd with the given options
+bprd_start()
+{
+	"$BPRD" -p "$PIDFILE" $BPRD_ARGS "$@" > /tmp/bprd-bench.log 2>&1 &
+	BPRD_PID=$!
+}
+
+bprd_alive()
+{
+	kill -0 "$BPRD_PID" 2> /dev/null || die "bprd exited, see /tmp/bprd-bench.log"
+}
+
+# start bprd with the given options and give it time to bind its queues
+bprd_run()
+{
+	bprd_start "$@"
+	sleep 2
+	bprd_alive
+}
+
+bprd_stop()
+{
+	kill "$BPRD_PID" 2> /dev/null
+	wait "$BPRD_PID" 2> /dev/null
+}
+
+# packets the kernel has handed to netfilter queue $1 so far
+nfq_seq()
+{
+	awk -v q="$1" '$1 == q { print $8 }' /proc/net/netfilter/nfnetlink_queue
+}
+
+# packets of netfilter queue $1 the kernel or userspace dropped so far
+nfq_dropped()
+{
+	awk -v q="$1" '$1 == q { print $6 + $7 }' /proc/net/netfilter/nfnetlink_queue
+}
+
+# user plus system CPU time of process $1 (clock ticks)
+cpu_ticks()
+{
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# median and 90th percentile of the numbers read, one per line
+percentiles()
+{
+	sort -n | awk '{ v[NR] = $1 } END { if (NR) printf "%.1f %.1f", v[int((NR + 1) / 2)], v[int((NR * 9 + 9) / 10)] }'
+}
+
+bench_release()
+{
+	local dest=$1 id=$2 n seq0 seq1 drop0 drop1 cpu0 cpu1 hz
+	shift 2
+	[ -n "$dest" ] && [ -n "$id" ] || die "usage: $0 release DEST ID [N...]"
+	hz=$(getconf CLK_TCK)
+
+	printf "%-14s %12s %12s %8s\n" "release_count" "released/s" "dropped/s" "cpu%"
+	for n in 1 "$@"; do
+		bprd_run -r "$dest,$id" --release_count="$n"
+		seq0=$(nfq_seq "$id"); drop0=$(nfq_dropped "$id"); cpu0=$(cpu_ticks "$BPRD_PID")
+		iperf3 -c "$dest" -u -b "$RATE" -t "$DURATION" > /dev/null || die "iperf3 failed"
+		seq1=$(nfq_seq "$id"); drop1=$(nfq_dropped "$id"); cpu1=$(cpu_ticks "$BPRD_PID")
+		bprd_stop
+		printf "%-14s %12d %12d %8d\n" "$n" \
+			$(( (seq1 - seq0 - (drop1 - drop0)) / DURATION )) \
+			$(( (drop1 - drop0) / DURATION )) \
+			$(( 100 * (cpu1 - cpu0) / (hz * DURATION) ))
+	done
+}
+
+# time since $1 (nanoseconds since the epoch) in milliseconds
+elapsed_ms()
+{
+	echo $(( ($(date +%s%N) - $1) / 1000000 ))
+}
+
+bench_startup()
+{
+	local n i t0 ms elems chain
+	[ $# -gt 0 ] || set -- 10 100 1000
+	command -v nft > /dev/null || die "nft not found"
+
+	printf "%-12s %12s\n" "commodities" "startup ms"
+	for n in "$@"; do
+		for (( i = 0; i < n; i++ )); do
+			echo "10.123.$(( i / 250 )).$(( i % 250 + 1 )),$i"
+		done > /tmp/bprd-bench.conf
+
+		nft delete table ip bprd 2> /dev/null
+		t0=$(date +%s%N)
+		bprd_start --config=/tmp/bprd-bench.conf
+		while :; do
+			elems=$(nft list map ip bprd queues 2> /dev/null | grep -o ' : ' | wc -l)
+			[ "$elems" -ge "$n" ] && break
+			bprd_alive
+			[ "$(elapsed_ms "$t0")" -lt 60000 ] || die "only $elems of $n map elements after 60 s"
+			sleep 0.01
+		done
+		ms=$(elapsed_ms "$t0")
+
+		# the queue expression must take its queue number from the map
+		for chain in prerouting output; do
+			nft list chain ip bprd $chain | grep -q 'queue.* ip daddr map @queues' ||
+				die "chain $chain does not queue by the map"
+		done
+		bprd_stop
+		printf "%-12s %12d\n" "$n" "$ms"
+	done
+}
+
+bench_discipline()
+{
+	local dest=$1 id=$2 d rtt goodput
+	shift 2
+	[ -n "$dest" ] && [ -n "$id" ] || die "usage: $0 discipline DEST ID [DISC...]"
+	[ $# -gt 0 ] || set -- fifo lifo hybrid,deadline=50
+
+	printf "%-24s %10s %10s %14s\n" "discipline" "p50 ms" "p90 ms" "goodput"
+	for d in "$@"; do
+		bprd_run -r "$dest,$id,discipline=$d"
+		ping -i 0.05 -w "$DURATION" "$dest" | sed -n 's/.*time=\([0-9.]*\).*/\1/p' > /tmp/bprd-bench.rtt &
+		goodput=$(iperf3 -c "$dest" -u -b "$RATE" -t "$DURATION" | awk '/receiver/ { print $7 " " $8 }')
+		wait $!
+		bprd_stop
+		rtt=$(percentiles < /tmp/bprd-bench.rtt)
+		printf "%-24s %10s %10s %14s\n" "$d" ${rtt:-- -} "${goodput:--}"
+	done
+}
+
+[ "$(id -u)" -eq 0 ] || die "must be run as root"
+[ -x "$BPRD" ] || die "no bprd binary at $BPRD"
+
+case "$1" in
+	release)
+		shift
+		bench_release "$@"
+		;;
+	discipline)
+		shift
+		bench_discipline "$@"
+		;;
+	startup)
+		shift
+		bench_startup "$@"
+		;;
+	*)
+		die "usage: $0 release|discipline DEST ID [...] or $0 startup [N...]"
+		;;
+esac
@@ -15,62 +15,384 @@
  * \{
  */
 
+#define _GNU_SOURCE         /* for CPU_SET(), pthread_attr_setaffinity_np(), recvmmsg() */
+
+#include <arpa/inet.h>      /* for ntohl() */
+#include <errno.h>
 #include <pthread.h>        /* for pthread_create() */
+#include <sched.h>          /* for cpu_set_t */
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>         /* for strerror() */
 #include <sys/queue.h>      /* for LIST_*() */
+#include <sys/socket.h>     /* for recvmmsg(), setsockopt() */
 #include <unistd.h>
 
+#include <linux/netlink.h>  /* for NETLINK_NO_ENOBUFS */
+
+#include <linux/netfilter.h>                        /* for NF_ACCEPT */
 #include <libnetfilter_queue/libnetfilter_queue.h>  /* for nfq_*() */
 
+#include "classifier.h"
 #include "commodity.h"
 #include "bprd.h"
+#include "diffheap.h"
 #include "fifo_queue.h"
+#include "flowlet.h"
 #include "logger.h"
+#include "netif.h"
+#include "nftables.h"
+#include "router.h"
+#include "util.h"       /* for monotime_usec() */
 
 
-static struct nfq_handle *h;    /**< Handle to netfilter queue library. */
+#define BACKLOGGER_RECV_BATCH 64        /**< Maximum number of netlink messages drained per recvmmsg() call. */
+#define BACKLOGGER_RECV_BUFSIZE 4096    /**< Size of the buffer holding a single netlink message (bytes). */
+#define BACKLOGGER_COPY_RANGE 64        /**< Number of bytes copied to userspace from the start of each packet. */
+#define BACKLOGGER_COPY_ALL 0xffff      /**< Number of bytes copied to userspace when packets may be marked ECN CE. */
+#define BACKLOGGER_RECV_BUFSIZE_ALL (BACKLOGGER_COPY_ALL + BACKLOGGER_RECV_BUFSIZE) /**< Message buffer size then. */
+#define BACKLOGGER_GSO_HDR4 40          /**< IPv4 and TCP headers repeated in each segment of a GSO packet (bytes). */
+#define BACKLOGGER_GSO_HDR6 60          /**< IPv6 and TCP headers repeated in each segment of a GSO packet (bytes). */
+#define BACKLOGGER_OVERRUN_LOG 10000000 /**< Least time between two logs of backlogger socket overruns (useconds). */
+#define BACKLOGGER_PROC_QUEUES "/proc/net/netfilter/nfnetlink_queue" /**< Kernel's per netfilter queue counters. */
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
 
 
 /**
- * Release packets back to kernel.
+ * \struct backlogger_group
+ * A group of commodities whose netfilter queues are serviced by one netlink socket and one backlogger thread.
+ * \var backlogger_group::h
+ * Handle to netfilter queue library, owns the netlink socket of this group.
+ * \var backlogger_group::cpu
+ * CPU the servicing thread is pinned to, or -1 if the thread may run on any CPU.
+ * \var backlogger_group::overruns
+ * Number of times the netlink socket reported that enqueue notifications were lost (ENOBUFS).
+ */
+typedef struct backlogger_group {
+    struct nfq_handle *h;
+    int cpu;
+    uint32_t overruns;
+} backlogger_group_t;
+
+/**
+ * \struct backlogger_shared
+ * A netfilter queue shared by the commodities whose destinations hash onto it (\see nftables_install).
+ * \var backlogger_shared::qh
+ * The netfilter queue handle.
+ * \var backlogger_shared::last_id
+ * The ID of the most recent packet on this queue.
+ * \var backlogger_shared::overruns
+ * Number of packet IDs skipped because the kernel dropped the packet or its enqueue notification.
+ */
+typedef struct backlogger_shared {
+    struct nfq_q_handle *qh;
+    uint32_t last_id;
+    uint32_t overruns;
+} backlogger_shared_t;
+
+static backlogger_group_t *groups;  /**< Backlogger groups, one per backlogger thread. */
+static uint32_t ngroups;            /**< Number of backlogger groups. */
+static backlogger_shared_t *shared; /**< Shared netfilter queues, bprd.shared_queues of them. */
+static classifier_t classifier;     /**< Commodity rules, for classifying packets of shared queues. */
+static uint32_t *reconcile_len;     /**< Commodity queue lengths read by backlogger_reconcile(), in list order. */
+static uint32_t kernel_drops;       /**< Packets the kernel dropped from our netfilter queues, as of the last reconcile. */
+static flowlet_table_t flowlets;    /**< Flowlets of released packets, only if bprd.flowlet_gap. */
+static uint32_t flags_refused;      /**< NFQA_CFG_F_* flags the kernel refused to set on a netfilter queue. */
+static commodity_t *drr_current;    /**< Tied commodity in the middle of its deficit round-robin turn, if any. */
+
+
+/**
+ * Move the commodity whose deficit round-robin turn it is to the front of the plan (\see diffheap_turn).
  *
- * Find the commodity with the largest backlog differential and send \a count packets from it.
+ * Nothing is moved unless bprd.drr_quantum is set and at least two commodities are tied for the largest weighted
+ * differential.  The commodity joins the plan if it was not in it, pushing out the last one if the plan is full.
  *
- * \param count Number of packets to release.
- */ 
-void backlogger_packet_release(unsigned int count) {
+ * \param plan Commodities to release from, largest weighted differential first.
+ * \param diffs Backlog differentials of the commodities.
+ * \param n Number of commodities, updated if the commodity joins the plan.
+ *
+ * \return Number of commodities at the front of the plan taking a turn, zero or one.
+ */
+static uint32_t backlogger_drr_order(commodity_t **plan, uint32_t *diffs, uint32_t *n) {
+
+    commodity_t *c;
+    uint32_t diff, i;
+
+    if (!bprd.drr_quantum) {
+        return 0;
+    }
+
+    if ((c = diffheap_turn(&diff)) == NULL) {
+        drr_current = NULL;
+        return 0;
+    }
+
+    for (i = 0; i < *n && plan[i] != c; i++);
+    if (i == *n && *n < bprd.release_commodities) {
+        (*n)++;
+    }
+    for (i = (i < *n) ? i : *n - 1; i > 0; i--) {
+        plan[i] = plan[i - 1];
+        diffs[i] = diffs[i - 1];
+    }
+    plan[0] = c;
+    diffs[0] = diff;
+
+    return 1;
+}
+
+
+/**
+ * Shed packets that have waited too long from every commodity queue (\see fifo_aqm).
+ *
+ * Queues that are not being released from, such as those whose next hop has stalled, are the ones whose sojourn time
+ * grows, so every queue is checked rather than only those planned for release.  Only to be called from the releasing
+ * thread, once per release tick.
+ */
+void backlogger_aqm() {
 
     elm_t *e;
-    commodity_t *c = NULL;
-    commodity_t *ctemp;
-    uint32_t diffopt = 0;
 
-    /* search for largest max differential */
+    if (!bprd.aqm_target) {
+        return;
+    }
+
     for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
-        ctemp = (commodity_t *)e->data;
+        fifo_aqm(((commodity_t *)e->data)->queue);
+    }
+}
+
+
+/**
+ * Release packets back to kernel.
+ *
+ * Plan the release by taking up to bprd.release_commodities commodities with the largest backlog differentials,
+ * weighted by the commodities' weights, and send packets from each in turn until \a count are sent.  Each commodity
+ * sends no more than half its differential, in packets or bytes, and what it cannot use passes on to the next one.
+ * Differentials that include head-of-line delays (\see commodity_backlog) are not capped.  Shadow queues are served
+ * what each commodity is granted, even if its real queue holds less (\see fifo_shadow_serve).
+ * When more than one packet of a commodity is to be sent, verdicts are issued as a single batch (\see
+ * fifo_send_packets).  GSO packets count as the number of segments they stand for.  Under BPRD_STEERING_MARK, the
+ * packets are marked for the commodity's best next hop, unless they belong to an active flowlet (\see flowlet_mark),
+ * and held back if it has none.
+ *
+ * Commodities tied for the largest differential take turns by deficit round-robin (\see backlogger_drr_order): the
+ * commodity whose turn it is goes first, each turn adds bprd.drr_quantum packets or bytes to its deficit, and the turn
+ * lasts until the deficit is spent, the commodity can send no more, or a later release continues it.  Whatever the
+ * turn leaves of the release count goes to the rest of the plan as usual.
+ *
+ * \param count Number of packets (segments) to release.
+ *
+ * \return Number of packets (segments) released.
+ */ 
+unsigned int backlogger_packet_release(unsigned int count) {
 
-        if (ctemp->backdiff > diffopt) {
-            c = ctemp;
-            diffopt = ctemp->backdiff;
+    commodity_t *plan[DIFFHEAP_TOP_MAX];
+    uint32_t diffs[DIFFHEAP_TOP_MAX];
+    commodity_t *c;
+    uint32_t diffopt, mark, i, n, g, allowed, bytes, segs, segs_out, bytes_out;
+    unsigned int sent = 0;
+
+    /* plan the release: serve commodities in order of weighted max differential, each up to its own cap, until the
+     * budget of count packets is spent (greedy max-weight), tied commodities taking turns */
+    n = diffheap_top(plan, diffs, bprd.release_commodities);
+    g = backlogger_drr_order(plan, diffs, &n);
+    for (i = 0; i < n && sent < count; i++) {
+        c = plan[i];
+        diffopt = diffs[i];
+
+        if (bprd.steering == BPRD_STEERING_MARK) {
+            if ((mark = router_mark(c)) == 0) {
+                continue;
+            }
+            fifo_set_mark(c->queue, mark);
+        }
+
+        /* only send up to (diffopt+1)/2 packets or bytes! otherwise gradient will grow in the reverse direction */
+        /* a delay differential says nothing of how many packets it takes to even out, only the count limits those */
+        segs = count - sent;
+        bytes = UINT32_MAX;
+        allowed = (bprd.pressure == BPRD_PRESSURE_BACKLOG) ? (diffopt+1)/2 : UINT32_MAX;
+        if (i < g) {
+            if (c != drr_current) {
+                /* the commodity's turn starts */
+                c->deficit += bprd.drr_quantum;
+                drr_current = c;
+            }
+            allowed = (c->deficit <= 0) ? 0 : ((uint64_t)c->deficit < allowed) ? (uint32_t)c->deficit : allowed;
+        }
+        if (bprd.backlog_units == BPRD_UNITS_BYTES) {
+            bytes = allowed;
+        } else {
+            segs = (allowed < segs) ? allowed : segs;
+        }
+        /* the shadow queue is served what the decision grants, whatever the real queue holds */
+        fifo_shadow_serve(c->queue, (bprd.backlog_units == BPRD_UNITS_BYTES) ? bytes : segs);
+
+        /* release this commodity's share, batching verdicts whenever more than one packet is sent */
+        segs_out = fifo_segments_out(c->queue);
+        bytes_out = fifo_bytes_out(c->queue);
+        if (allowed > 0) {
+            fifo_send_bytes(c->queue, segs, bytes);
+        }
+        segs_out = fifo_segments_out(c->queue) - segs_out;
+        bytes_out = fifo_bytes_out(c->queue) - bytes_out;
+        sent += segs_out;
+
+        if (i < g) {
+            c->deficit -= (bprd.backlog_units == BPRD_UNITS_BYTES) ? bytes_out : segs_out;
+            if (c->deficit <= 0 || sent < count) {
+                /* the turn ends unless only the release count cut it short, an idle commodity keeps no credit */
+                diffheap_turn_end(c);
+                drr_current = NULL;
+                c->deficit = (fifo_segments(c->queue) == 0) ? 0 : c->deficit;
+            }
         }
     }
 
-    if (c) {
-        /* only send up to min(count,(diffopt+1)/2) packets! otherwise gradient will grow in the reverse direction */
-        count = (diffopt+1)/2 > count ? count : (diffopt+1)/2;
-        /* release up to count packets of this commodity */
-        while (count--) {fifo_send_packet(c->queue);}
+    return sent;
+}
+
+
+/**
+ * Callback function classifying packets of a shared netfilter queue into their commodities.
+ *
+ * Function prototype specified by libnetfilter_queue
+ *
+ * The packet's fields are read from the copied IP header and looked up among the commodities' rules.  A destination
+ * always hashes onto the same shared queue, so each commodity queue is still filled by a single backlogger thread.
+ * Packets belonging to no commodity are accepted straight away.
+ *
+ * \see fifo_enqueue
+ *
+ * \param qh
+ * \param nfmsg
+ * \param nfa
+ * \param data The backlogger_shared_t of the queue.
+ */
+static int backlogger_classify(struct nfq_q_handle *qh,
+                               struct nfgenmsg *nfmsg,
+                               struct nfq_data *nfa,
+                               void *data) {
+
+    backlogger_shared_t *s = (backlogger_shared_t *)data;
+    struct nfqnl_msg_packet_hdr *ph;
+    unsigned char *payload;
+    commodity_t *c;
+    uint32_t id;
+    int n;
+
+    if ((ph = nfq_get_msg_packet_hdr(nfa)) == NULL) {
+        return 0;
+    }
+
+    id = ntohl(ph->packet_id);
+    if (id > s->last_id + 1) {
+        __atomic_add_fetch(&s->overruns, id - s->last_id - 1, __ATOMIC_RELAXED);
+    }
+    s->last_id = id;
+
+    n = nfq_get_payload(nfa, &payload);
+    if ((c = classifier_lookup(&classifier, payload, n, bprd.ipver)) != NULL) {
+        fifo_enqueue(c->queue, qh, nfmsg, nfa, id);
+    } else {
+        nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
+    }
+
+    // Callback should return < 0 to stop processing
+    return 0;
+}
+
+
+/**
+ * Set a flag of a netfilter queue, or carry on without it if the kernel does not support it.
+ *
+ * The kernel refuses the flag for every queue alike, so only the first refusal is logged and later queues are not
+ * asked again.
+ *
+ * \param qh The netfilter queue handle.
+ * \param flag The NFQA_CFG_F_* flag.
+ * \param what Description of the flag for the log.
+ */
+static void backlogger_queue_flag(struct nfq_q_handle *qh, uint32_t flag, const char *what) {
+
+    if ((flags_refused & flag) || nfq_set_queue_flags(qh, flag, flag) >= 0) {
+        return;
+    }
+
+    flags_refused |= flag;
+    BPRD_LOG_WARN("Can't enable %s, kernel too old?  Continuing without it", what);
+}
+
+
+/**
+ * Configure a netfilter queue serviced by a backlogger thread.
+ *
+ * \param qh The netfilter queue handle.
+ */
+static void backlogger_queue_init(struct nfq_q_handle *qh) {
+
+    /* copy just enough of each packet to read its headers, or whole packets to hand them back marked */
+    if (nfq_set_mode(qh, NFQNL_COPY_PACKET, (bprd.ecn_backlog || bprd.ecn_sojourn) ? BACKLOGGER_COPY_ALL : BACKLOGGER_COPY_RANGE) < 0) {
+        BPRD_LOG_ERR("Can't set packet_copy mode");
+    }
+
+    if (bprd.queue_maxlen && nfq_set_queue_maxlen(qh, bprd.queue_maxlen) < 0) {
+        BPRD_LOG_ERR("Can't set netfilter queue length");
+    }
+
+    /* route packets normally rather than dropping them when the kernel's queue is full, bprd's own queues fail open
+     * regardless */
+    if (bprd.fail_open) {
+        backlogger_queue_flag(qh, NFQA_CFG_F_FAIL_OPEN, "fail-open");
+    }
+
+    /* let GSO packets through whole instead of having the kernel segment them, segments count as one each otherwise */
+    if (bprd.gso) {
+        backlogger_queue_flag(qh, NFQA_CFG_F_GSO, "GSO packets");
+    }
+}
+
+
+/**
+ * Size the receive buffer of a backlogger netlink socket and optionally stop it from reporting overruns.
+ *
+ * SO_RCVBUFFORCE is tried first so that bprd.rcvbuf may exceed net.core.rmem_max, falling back to SO_RCVBUF.
+ *
+ * \param fd The netlink socket.
+ */
+static void backlogger_socket_init(int fd) {
+
+    int val;
+
+    if (bprd.rcvbuf) {
+        val = (int)bprd.rcvbuf;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) < 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) < 0) {
+            BPRD_LOG_ERR("Unable to set netlink receive buffer size: %s", strerror(errno));
+        }
+    }
+
+    if (bprd.no_enobufs) {
+        val = 1;
+        if (setsockopt(fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &val, sizeof(val)) < 0) {
+            BPRD_LOG_ERR("Unable to set NETLINK_NO_ENOBUFS: %s", strerror(errno));
+        }
     }
 }
 
 
 /**
- * Initialize the backlogger thread.
+ * Initialize the backlogger groups.
  *
- * Open connection to libnetfilter, link each commodity with a netfilter queue, and add iptables rules to filter 
- * commodities into their respective netfilter queues.
+ * Open one connection to libnetfilter per backlogger group, link each commodity with a netfilter queue on the socket
+ * of its group, and install nftables rules to filter commodities into their respective netfilter queues.  Commodities
+ * are assigned to groups in round-robin order.  If bprd.shared_queues is positive, commodities share that many
+ * netfilter queues instead, which are assigned to groups in round-robin order and classified by backlogger_classify().
  *
  * \pre All commodities have been initialized and exist in bprd.clist.  Each commodity_t element in bprd.clist has 
  * 'uint32_t nfq_id' set and 'fifo_t *queue == NULL'
@@ -82,119 +404,330 @@ static void backlogger_init() {
 
     elm_t *e;
     commodity_t *c;
+    uint32_t i;
+    int mtu = 0;
 
     /** \todo determine if setpriorty() must be called to improve performance */
 
-    /* opening netfilter_queue library handle */
-    h = nfq_open();
-    if (!h) {
-        BPRD_LOG_ERR("error during nfq_open()");
+    if (bprd.gso && (mtu = netif_mtu(bprd.if_name)) <= 0) {
+        BPRD_LOG_ERR("Unable to read MTU of interface %s", bprd.if_name);
+    }
+
+    if (diffheap_init(&bprd.clist, bprd.drr_tolerance) < 0) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+
+    if (bprd.flowlet_gap && flowlet_init(&flowlets, bprd.flowlet_table, bprd.flowlet_gap) < 0) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+
+    ngroups = bprd.backlogger_threads ? bprd.backlogger_threads : 1;
+    if ((groups = (backlogger_group_t *)calloc(ngroups, sizeof(backlogger_group_t))) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+
+    for (i = 0; i < ngroups; i++) {
+        /* opening netfilter_queue library handle */
+        groups[i].h = nfq_open();
+        if (!groups[i].h) {
+            BPRD_LOG_ERR("error during nfq_open()");
+        }
+        groups[i].cpu = bprd.backlogger_ncpus ? bprd.backlogger_cpus[i % bprd.backlogger_ncpus] : -1;
+        backlogger_socket_init(nfq_fd(groups[i].h));
     }
 
+    /* the nf_queue handler binding is per protocol family, so only the first handle needs to (re)bind it */
     /* unbind existing nf_queue handler for AF_INET (if any) */
     /** \todo extend to IPv6 handling */
-    if (nfq_unbind_pf(h, AF_INET) < 0) {
+    if (nfq_unbind_pf(groups[0].h, AF_INET) < 0) {
         BPRD_LOG_ERR("Error during nfq_unbind_pf()");
     }
 
     /* bind nfnetlink_queue as nf_queue handler for AF_INET */
     /** \todo extend to IPv6 handling */
-    if (nfq_bind_pf(h, AF_INET) < 0) {
+    if (nfq_bind_pf(groups[0].h, AF_INET) < 0) {
         BPRD_LOG_ERR("Error during nfq_bind_pf()");
     }
 
+    if (bprd.shared_queues) {
+        if ((shared = (backlogger_shared_t *)calloc(bprd.shared_queues, sizeof(backlogger_shared_t))) == NULL) {
+            BPRD_LOG_ERR("Unable to allocate memory");
+        }
+        classifier_init(&classifier);
+    }
+
+    for (i = 0; i < bprd.shared_queues; i++) {
+        /* bind this group's socket to shared queue */
+        shared[i].qh = nfq_create_queue(groups[i % ngroups].h, bprd.shared_queue + i, &backlogger_classify, &shared[i]);
+        if (!shared[i].qh) {
+            BPRD_LOG_ERR("Error during nfq_create_queue()");
+        }
+        backlogger_queue_init(shared[i].qh);
+    }
+
     /* iterate through list looking for matching element */
-    for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
+    for (e = LIST_FIRST(&bprd.clist), i = 0; e != NULL; e = LIST_NEXT(e, elms), i++) {
         c = (commodity_t *)e->data;
-        c->queue = (fifo_t *)malloc(sizeof(fifo_t));
-        fifo_init(c->queue);
+        if ((c->queue = (fifo_t *)malloc(sizeof(fifo_t))) == NULL || fifo_init(c->queue, bprd.queue_size) < 0) {
+            BPRD_LOG_ERR("Unable to allocate memory");
+        }
+        fifo_set_discipline(c->queue, c->disc, c->deadline);
+        fifo_set_aqm(c->queue, bprd.aqm_target, bprd.aqm_interval, bprd.max_backlog);
+        if (bprd.fail_open) {
+            fifo_set_fail_open(c->queue);
+        }
+        if (bprd.flowlet_gap) {
+            fifo_set_flowlets(c->queue, &flowlets);
+        }
+        fifo_set_ecn(c->queue, bprd.ecn_backlog, bprd.ecn_sojourn);
+        fifo_set_admission(c->queue, c->v, bprd.backlog_units == BPRD_UNITS_BYTES);
+        fifo_set_shadow(c->queue, bprd.shadow, bprd.backlog_units == BPRD_UNITS_BYTES);
+        if (bprd.gso) {
+            fifo_set_gso(c->queue, mtu, (bprd.ipver == AF_INET6) ? BACKLOGGER_GSO_HDR6 : BACKLOGGER_GSO_HDR4);
+        }
 
-        /* bind this socket to queue c->nfq_id */
-        c->queue->qh = nfq_create_queue(h, c->nfq_id, &fifo_add_packet, c->queue);
-        if (!c->queue->qh) {
-            BPRD_LOG_ERR("Error during nfq_create_queue()");
+        if (bprd.shared_queues) {
+            /* bprd_init() rejected commodities with the same rule, which the classifier cannot tell apart */
+            fifo_set_shared(c->queue);
+            if (classifier_add(&classifier, c) < 0) {
+                BPRD_LOG_ERR("Unable to add commodity rule to classifier");
+            }
+            continue;
         }
 
-        /* set packet copy mode to NFQNL_COPY_META */
-        if (nfq_set_mode(c->queue->qh, NFQNL_COPY_META, 0xffff) < 0) {
-            BPRD_LOG_ERR("Can't set packet_copy mode");
+        /* bind this group's socket to queue c->nfq_id */
+        c->queue->qh = nfq_create_queue(groups[i % ngroups].h, c->nfq_id, &fifo_add_packet, c->queue);
+        if (!c->queue->qh) {
+            BPRD_LOG_ERR("Error during nfq_create_queue()");
         }
+        backlogger_queue_init(c->queue->qh);
     }
 
-    /* flush iptables */
-    if (system("/sbin/iptables -t raw -F") < 0) {
-        BPRD_LOG_ERR("Unable to flush iptables");   
+    if ((reconcile_len = (uint32_t *)calloc(i ? i : 1, sizeof(uint32_t))) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate memory");
     }
 
-    int n;
-
-    char cmd[256];
-    netaddr_str_t naddr_str;
     struct netaddr naddr;
     union netaddr_socket nsaddr;
-   
+
     /* convert my address into a netaddr for easy comparison */
-    nsaddr.std = *bprd.saddr; 
+    nsaddr.std = *bprd.saddr;
     netaddr_from_socket(&naddr, &nsaddr);
 
-    /* set iptables for each commodity that is not destined to me */
-    for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
-        c = (commodity_t *)e->data;
+    /* queue each commodity that is not destined to me */
+    if (nftables_install(&bprd.clist, &naddr, (uint16_t)bprd.shared_queue, (uint16_t)bprd.shared_queues) < 0) {
+        BPRD_LOG_ERR("Unable to install nftables rules");
+    }
+}
+
+
+/**
+ * Loop endlessly and handle commodity packets of one backlogger group.
+ *
+ * Up to BACKLOGGER_RECV_BATCH netlink messages are drained per system call.  Overruns of the netlink socket are
+ * counted and otherwise ignored; the affected queues resynchronize on the ID of their next packet (\see fifo_add_packet).
+ * The count is logged at most every BACKLOGGER_OVERRUN_LOG, as overruns come in bursts under load.
+ *
+ * \param arg The backlogger group serviced by this thread.
+ */
+static void *backlogger_thread_main(void *arg) {
+
+    backlogger_group_t *g = (backlogger_group_t *)arg;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *bufs;
+    size_t bufsize = (bprd.ecn_backlog || bprd.ecn_sojourn) ? BACKLOGGER_RECV_BUFSIZE_ALL : BACKLOGGER_RECV_BUFSIZE;
+    uint64_t logged = 0, now;
+    uint32_t overruns;
+    int fd, rv, i;
+
+    if ((msgs = (struct mmsghdr *)calloc(BACKLOGGER_RECV_BATCH, sizeof(struct mmsghdr))) == NULL ||
+        (iovs = (struct iovec *)calloc(BACKLOGGER_RECV_BATCH, sizeof(struct iovec))) == NULL ||
+        (bufs = (char *)malloc(BACKLOGGER_RECV_BATCH * bufsize)) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+
+    for (i = 0; i < BACKLOGGER_RECV_BATCH; i++) {
+        iovs[i].iov_base = bufs + i * bufsize;
+        iovs[i].iov_len = bufsize;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-        /* skip commodity destined to me! */
-        if (netaddr_cmp(&naddr, &(c->cdata.addr)) == 0) {
+    fd = nfq_fd(g->h);
+
+    while (1) {
+        /* block until at least one message arrives, then take whatever else is already queued */
+        if ((rv = recvmmsg(fd, msgs, BACKLOGGER_RECV_BATCH, MSG_WAITFORONE, NULL)) < 0) {
+            if (errno == ENOBUFS) {
+                /* the kernel dropped notifications, keep going and let the queues resynchronize */
+                overruns = __atomic_add_fetch(&g->overruns, 1, __ATOMIC_RELAXED);
+                if ((now = monotime_usec()) - logged >= BACKLOGGER_OVERRUN_LOG) {
+                    BPRD_LOG_DBG("Backlogger socket overruns: %u", overruns);
+                    logged = now;
+                }
+            } else if (errno != EINTR) {
+                BPRD_LOG_ERR("Unable to receive from backlogger socket: %s", strerror(errno));
+            }
             continue;
         }
-   
-        n = snprintf(cmd, 256, "/sbin/iptables -t raw -A OUTPUT -d %s -j NFQUEUE --queue-num %d", netaddr_to_string(&naddr_str, &c->cdata.addr), c->nfq_id);
-        if (n < 0 || n == 256) {
-            BPRD_LOG_ERR("Unable to construct system string");
-        }
-        system(cmd);
 
-        n = snprintf(cmd, 256, "/sbin/iptables -t raw -A PREROUTING -d %s -j NFQUEUE --queue-num %d", netaddr_to_string(&naddr_str, &c->cdata.addr), c->nfq_id);
-        if (n < 0 || n == 256) {
-            BPRD_LOG_ERR("Unable to construct system string");
+        /* main backlogger loop */
+        for (i = 0; i < rv; i++) {
+            nfq_handle_packet(g->h, (char *)iovs[i].iov_base, msgs[i].msg_len);
         }
-        system(cmd);
     }
+    /** \todo clean up if while loop breaks? */
+
+    return NULL;
 }
 
 
 /**
- * Loop endlessly and handle commodity packets.
+ * Number of overruns reported by the backlogger sockets.
  *
- * \param arg Unused.
+ * \return Sum of overruns over all backlogger groups.
  */
-static void *backlogger_thread_main(void *arg __attribute__((unused)) ) {
+uint32_t backlogger_overruns() {
 
-    backlogger_init();
+    uint32_t i, n = 0;
 
-    int fd, rv;
-    /** \todo determine if this is the correct way to allocate buffer */
-    char buf[4096] __attribute__ ((aligned));
+    for (i = 0; i < ngroups; i++) {
+        n += __atomic_load_n(&groups[i].overruns, __ATOMIC_RELAXED);
+    }
 
-    fd = nfq_fd(h);
+    return n;
+}
 
-    while ((rv = recv(fd, buf, sizeof(buf),0)) && rv >=0) {
-        /* main backlogger loop */
-        nfq_handle_packet(h, buf, rv);
-        //BPRD_LOG_DBG("Handling Packet!");
+
+/**
+ * Returns the number of packets the kernel dropped from shared netfilter queues before they could be classified.
+ *
+ * \return Sum of overruns over all shared queues.
+ */
+uint32_t backlogger_shared_overruns() {
+
+    uint32_t i, n = 0;
+
+    for (i = 0; i < bprd.shared_queues; i++) {
+        n += __atomic_load_n(&shared[i].overruns, __ATOMIC_RELAXED);
     }
-    /** \todo clean up if while loop breaks? */
 
-    return NULL;
+    return n;
+}
+
+
+/**
+ * Correct commodity backlogs for packets the kernel no longer holds.
+ *
+ * The number of packets held by, and dropped from, each netfilter queue is read from BACKLOGGER_PROC_QUEUES.  A
+ * commodity with a netfilter queue of its own that counts more packets than the kernel holds forgets its oldest
+ * packets (\see fifo_forget), rather than letting its backlog drift upwards forever.  Queue lengths are read before
+ * the kernel's counts, so packets arriving in between are never mistaken for lost ones.  The kernel only counts whole
+ * queues, so commodities of shared queues are not corrected.  Only to be called from the releasing thread.
+ */
+void backlogger_reconcile() {
+
+    FILE *fp;
+    char line[256];
+    elm_t *e;
+    commodity_t *c;
+    uint32_t i, qnum, total, dropped, user_dropped, drops = 0;
+
+    for (e = LIST_FIRST(&bprd.clist), i = 0; e != NULL; e = LIST_NEXT(e, elms), i++) {
+        reconcile_len[i] = fifo_length(((commodity_t *)e->data)->queue);
+    }
+
+    if ((fp = fopen(BACKLOGGER_PROC_QUEUES, "r")) == NULL) {
+        return;
+    }
+
+    /* queue_num peer_portid queue_total copy_mode copy_range queue_dropped user_dropped id_sequence 1 */
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%u %*u %u %*u %*u %u %u", &qnum, &total, &dropped, &user_dropped) != 4) {
+            continue;
+        }
+
+        if (bprd.shared_queues) {
+            if (qnum - bprd.shared_queue < bprd.shared_queues) {
+                drops += dropped + user_dropped;
+            }
+            continue;
+        }
+
+        for (e = LIST_FIRST(&bprd.clist), i = 0; e != NULL; e = LIST_NEXT(e, elms), i++) {
+            c = (commodity_t *)e->data;
+            if (c->nfq_id == qnum) {
+                drops += dropped + user_dropped;
+                if (total < reconcile_len[i]) {
+                    fifo_forget(c->queue, reconcile_len[i] - total);
+                }
+                break;
+            }
+        }
+    }
+
+    fclose(fp);
+    __atomic_store_n(&kernel_drops, drops, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the number of packets the kernel dropped from our netfilter queues, because they were full or their
+ * enqueue notification could not be delivered, as of the last call to backlogger_reconcile().
+ *
+ * \return Number of kernel drops.
+ */
+uint32_t backlogger_kernel_drops() {
+
+    return __atomic_load_n(&kernel_drops, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Flowlets of released packets.
+ *
+ * \returns The flowlet table, only initialized if bprd.flowlet_gap.
+ */
+flowlet_table_t *backlogger_flowlets() {
+
+    return &flowlets;
 }
 
 
 /**
- * Create a new thread to handle continuous backlogger duties.
+ * Create new threads to handle continuous backlogger duties, one per backlogger group.
+ *
+ * Threads of groups with an assigned CPU are pinned to that CPU.
  */
 void backlogger_thread_create() {
 
-    /** \todo Check out pthread_attr options, currently set to NULL */
-    if (pthread_create(&(bprd.backlogger_tid), NULL, backlogger_thread_main, NULL) < 0) {
-        BPRD_LOG_ERR("Unable to create backlogger thread");
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    uint32_t i;
+
+    backlogger_init();
+
+    if ((bprd.backlogger_tid = (pthread_t *)calloc(ngroups, sizeof(pthread_t))) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+
+    for (i = 0; i < ngroups; i++) {
+        if (pthread_attr_init(&attr) != 0) {
+            BPRD_LOG_ERR("Unable to initialize backlogger thread attributes");
+        }
+        if (groups[i].cpu >= 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(groups[i].cpu, &cpus);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0) {
+                BPRD_LOG_ERR("Unable to pin backlogger thread to CPU %d", groups[i].cpu);
+            }
+        }
+
+        if (pthread_create(&(bprd.backlogger_tid[i]), &attr, backlogger_thread_main, &groups[i]) != 0) {
+            BPRD_LOG_ERR("Unable to create backlogger thread");
+        }
+        pthread_attr_destroy(&attr);
     }
 
     /** \todo wait here until process stops? pthread_join(htdata.tid)? */
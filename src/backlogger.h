@@ -12,7 +12,17 @@
 #ifndef __BACKLOGGER_H
 #define __BACKLOGGER_H
 
+#include <stdint.h>
+
+#include "flowlet.h"
+
 extern void backlogger_thread_create();
-extern void backlogger_packet_release(unsigned int count);
+extern void backlogger_aqm();
+extern unsigned int backlogger_packet_release(unsigned int count);
+extern uint32_t backlogger_overruns();
+extern uint32_t backlogger_shared_overruns();
+extern void backlogger_reconcile();
+extern uint32_t backlogger_kernel_drops();
+extern flowlet_table_t *backlogger_flowlets();
 
 #endif /* __BACKLOGGER_H */
@@ -27,7 +27,9 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <unistd.h>             /* for fork(), usleep() */
+#include <unistd.h>             /* for fork() */
+
+#include <linux/rtnetlink.h>    /* for RT_TABLE_LOCAL */
 
 #include <netlink/addr.h>
 #include <netlink/socket.h>
@@ -45,7 +47,9 @@
 #include "ntable.h"
 #include "util.h"
 #include "commodity.h"
+#include "diffheap.h"    /* for DIFFHEAP_TOP_MAX */
 #include "router.h"
+#include "scheduler.h"
 #include "netif.h"      /* for netif_nametoindex(), NETIF_NAMESIZE */
 
 
@@ -69,7 +73,81 @@ bprd_t bprd = {
     .hello_interval = BPRD_DEFAULT_HELLO_INTERVAL * USEC_PER_MSEC,
     .release_interval = BPRD_DEFAULT_RELEASE_INTERVAL * USEC_PER_MSEC,
     .update_interval = BPRD_DEFAULT_UPDATE_INTERVAL * USEC_PER_MSEC,
-    .neighbor_timeout = BPRD_DEFAULT_HELLO_INTERVAL * BPRD_DEFAULT_NEIGHBOR_TIMEOUT * USEC_PER_MSEC
+    .neighbor_timeout = BPRD_DEFAULT_HELLO_INTERVAL * BPRD_DEFAULT_NEIGHBOR_TIMEOUT * USEC_PER_MSEC,
+    .release_count = BPRD_DEFAULT_RELEASE_COUNT,
+    .backlogger_tid = NULL,
+    .backlogger_threads = BPRD_DEFAULT_BACKLOGGER_THREADS,
+    .backlogger_cpus = NULL,
+    .backlogger_ncpus = 0,
+    .rcvbuf = BPRD_DEFAULT_RCVBUF,
+    .no_enobufs = 0,
+    .queue_size = BPRD_DEFAULT_QUEUE_SIZE,
+    .backlog_units = BPRD_UNITS_PACKETS,
+    .aqm_target = 0,
+    .aqm_interval = BPRD_DEFAULT_AQM_INTERVAL * USEC_PER_MSEC,
+    .max_backlog = 0,
+    .shared_queue = 0,
+    .shared_queues = 0,
+    .gso = 0,
+    .fail_open = 0,
+    .queue_maxlen = 0,
+    .reconcile_interval = BPRD_DEFAULT_RECONCILE_INTERVAL * USEC_PER_MSEC,
+    .steering = BPRD_STEERING_ROUTE,
+    .mark_base = BPRD_DEFAULT_MARK_BASE,
+    .flowlet_gap = 0,
+    .flowlet_table = BPRD_DEFAULT_FLOWLET_TABLE,
+    .ecn_backlog = 0,
+    .ecn_sojourn = 0,
+    .release_rate = 0,
+    .release_burst = BPRD_DEFAULT_RELEASE_BURST,
+    .txq_low = 0,
+    .txq_high = 0,
+    .release_commodities = 1,
+    .drr_quantum = 0,
+    .drr_tolerance = 0,
+    .pressure = BPRD_PRESSURE_BACKLOG,
+    .pressure_mix = BPRD_DEFAULT_PRESSURE_MIX,
+    .shadow = 0,
+    .slot_length = 0,
+    .slot_guard = 0
+};
+
+/* values returned by getopt for options without a short equivalent */
+enum {
+    OPT_RELEASE_COUNT = 256,
+    OPT_BACKLOGGER_THREADS,
+    OPT_BACKLOGGER_CPUS,
+    OPT_RCVBUF,
+    OPT_NO_ENOBUFS,
+    OPT_QUEUE_SIZE,
+    OPT_BACKLOG_UNITS,
+    OPT_AQM_TARGET,
+    OPT_AQM_INTERVAL,
+    OPT_MAX_BACKLOG,
+    OPT_SHARED_QUEUE,
+    OPT_SHARED_QUEUES,
+    OPT_GSO,
+    OPT_FAIL_OPEN,
+    OPT_QUEUE_MAXLEN,
+    OPT_RECONCILE_INTERVAL,
+    OPT_STEERING,
+    OPT_MARK_BASE,
+    OPT_FLOWLET_GAP,
+    OPT_FLOWLET_TABLE,
+    OPT_ECN_BACKLOG,
+    OPT_ECN_SOJOURN,
+    OPT_RELEASE_RATE,
+    OPT_RELEASE_BURST,
+    OPT_TXQ_LOW,
+    OPT_TXQ_HIGH,
+    OPT_RELEASE_COMMODITIES,
+    OPT_DRR_QUANTUM,
+    OPT_DRR_TOLERANCE,
+    OPT_PRESSURE,
+    OPT_PRESSURE_MIX,
+    OPT_SHADOW,
+    OPT_SLOT_LENGTH,
+    OPT_SLOT_GUARD
 };
 
 /* options acted upon immediately before others */
@@ -90,6 +168,40 @@ static struct option long_options[] = {
     {"hello_interval", required_argument, NULL, 's'},
     {"release_interval", required_argument, NULL, 't'},
     {"update_interval", required_argument, NULL, 'u'},
+    {"release_count", required_argument, NULL, OPT_RELEASE_COUNT},
+    {"backlogger_threads", required_argument, NULL, OPT_BACKLOGGER_THREADS},
+    {"backlogger_cpus", required_argument, NULL, OPT_BACKLOGGER_CPUS},
+    {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+    {"no_enobufs", no_argument, NULL, OPT_NO_ENOBUFS},
+    {"queue_size", required_argument, NULL, OPT_QUEUE_SIZE},
+    {"backlog_units", required_argument, NULL, OPT_BACKLOG_UNITS},
+    {"aqm_target", required_argument, NULL, OPT_AQM_TARGET},
+    {"aqm_interval", required_argument, NULL, OPT_AQM_INTERVAL},
+    {"max_backlog", required_argument, NULL, OPT_MAX_BACKLOG},
+    {"shared_queue", required_argument, NULL, OPT_SHARED_QUEUE},
+    {"shared_queues", required_argument, NULL, OPT_SHARED_QUEUES},
+    {"gso", no_argument, NULL, OPT_GSO},
+    {"fail_open", no_argument, NULL, OPT_FAIL_OPEN},
+    {"queue_maxlen", required_argument, NULL, OPT_QUEUE_MAXLEN},
+    {"reconcile_interval", required_argument, NULL, OPT_RECONCILE_INTERVAL},
+    {"steering", required_argument, NULL, OPT_STEERING},
+    {"mark_base", required_argument, NULL, OPT_MARK_BASE},
+    {"flowlet_gap", required_argument, NULL, OPT_FLOWLET_GAP},
+    {"flowlet_table", required_argument, NULL, OPT_FLOWLET_TABLE},
+    {"ecn_backlog", required_argument, NULL, OPT_ECN_BACKLOG},
+    {"ecn_sojourn", required_argument, NULL, OPT_ECN_SOJOURN},
+    {"release_rate", required_argument, NULL, OPT_RELEASE_RATE},
+    {"release_burst", required_argument, NULL, OPT_RELEASE_BURST},
+    {"txq_low", required_argument, NULL, OPT_TXQ_LOW},
+    {"txq_high", required_argument, NULL, OPT_TXQ_HIGH},
+    {"release_commodities", required_argument, NULL, OPT_RELEASE_COMMODITIES},
+    {"drr_quantum", required_argument, NULL, OPT_DRR_QUANTUM},
+    {"drr_tolerance", required_argument, NULL, OPT_DRR_TOLERANCE},
+    {"pressure", required_argument, NULL, OPT_PRESSURE},
+    {"pressure_mix", required_argument, NULL, OPT_PRESSURE_MIX},
+    {"shadow", required_argument, NULL, OPT_SHADOW},
+    {"slot_length", required_argument, NULL, OPT_SLOT_LENGTH},
+    {"slot_guard", required_argument, NULL, OPT_SLOT_GUARD},
     {0,0,0,0}
 };
 
@@ -99,7 +211,15 @@ static void usage() {
     printf("Mandatory arguments to long options are mandatory for short options too.\n");
     printf("  -4, --v4                  \trun the protocol using IPv4 (default)\n");
     printf("  -6, --v6                  \trun the protocol using IPv6\n");
-    printf("  -r, --commodity=\"ADDR,ID\"     \tdefine a commodity via command-line\n");
+    printf("  -r, --commodity=\"ADDR,ID[,KEY=VALUE]...\"\n");
+    printf("                            \tdefine a commodity via command-line, where KEY is one of\n");
+    printf("                            \t  discipline=fifo|lifo|hybrid  release order (default is fifo)\n");
+    printf("                            \t  deadline=MS  under hybrid, release packets older than MS first\n");
+    printf("                            \t  class=N  tell apart commodities to ADDR (default is 0)\n");
+    printf("                            \t  weight=N  release first by differential times N (default is 1)\n");
+    printf("                            \t  src=PREFIX, proto=tcp|udp|N, sport=N, dport=N, dscp=N\n");
+    printf("                            \t           only match such packets to ADDR, requires --shared_queue\n");
+    printf("                            \t  v=N  admit local packets only while the backlog is below N (default is all)\n");
     printf("  -c, --config=FILE         \tread configuration parameters from FILE\n");
     printf("  -d, --daemon              \trun the program as a daemon\n");
     printf("  -h, --help                \tprint this help message\n");
@@ -108,6 +228,40 @@ static void usage() {
     printf("  -s, --hello_interval=MS   \tset rate to MS (mseconds)\n");
     printf("  -t, --release_interval=MS \tset rate to MS (mseconds)\n");
     printf("  -u, --update_interval=MS  \tset rate to MS (mseconds)\n");
+    printf("      --release_count=N     \trelease up to N packets every release interval (default is 1)\n");
+    printf("      --backlogger_threads=N\tservice commodity queues with N threads, each with its own socket (default is 1)\n");
+    printf("      --backlogger_cpus=LIST\tpin backlogger threads to the comma-separated CPUs in LIST\n");
+    printf("      --rcvbuf=BYTES        \tset backlogger socket receive buffer to BYTES (default is 4194304)\n");
+    printf("      --no_enobufs          \tdo not report backlogger socket overruns as errors\n");
+    printf("      --queue_size=N        \ttrack up to N packets per commodity (default is 1024)\n");
+    printf("      --backlog_units=UNITS \tmeasure backlog differentials in packets or bytes (default is packets)\n");
+    printf("      --aqm_target=MS       \tdrop packets queued longer than MS (mseconds) for an interval (default is off)\n");
+    printf("      --aqm_interval=MS     \tset AQM interval to MS (mseconds) (default is 100)\n");
+    printf("      --max_backlog=N       \tdrop packets arriving while N packets of their commodity are queued\n");
+    printf("      --shared_queue=ID     \tqueue all commodities to netfilter queue ID and classify them in userspace\n");
+    printf("      --shared_queues=N     \tbalance commodities by destination over N queues from the shared queue ID\n");
+    printf("      --gso                 \tqueue GSO packets whole and count their backlog in segments\n");
+    printf("      --fail_open           \taccept rather than drop packets arriving at a full queue\n");
+    printf("      --queue_maxlen=N      \tlet the kernel hold up to N packets per netfilter queue (default is kernel's)\n");
+    printf("      --reconcile_interval=MS\tcorrect backlogs against kernel queue counts every MS (mseconds) (default is 1000)\n");
+    printf("      --steering=METHOD     \tsteer packets to next hops by route or by mark (default is route)\n");
+    printf("      --mark_base=N         \tmark packets for neighbors with N, N+1, ... and route them by the same tables (default is 1000)\n");
+    printf("      --flowlet_gap=MS      \tkeep flows on their next hop until idle for MS (mseconds), needs mark steering (default is off)\n");
+    printf("      --flowlet_table=N     \ttrack up to N flows for flowlets (default is 4096)\n");
+    printf("      --ecn_backlog=N       \tmark ECN-capable packets CE while N packets of their commodity are queued (default is off)\n");
+    printf("      --ecn_sojourn=MS      \tmark ECN-capable packets CE once queued for MS (mseconds) (default is off)\n");
+    printf("      --release_rate=PPS    \trelease up to PPS packets per second instead of per release interval\n");
+    printf("      --release_burst=N     \tlet up to N unused packets of the release rate accumulate (default is 8)\n");
+    printf("      --txq_low=N           \tstart releasing once fewer than N packets wait in the interface's qdisc\n");
+    printf("      --txq_high=N          \tstop releasing once N packets wait in the interface's qdisc (default is off)\n");
+    printf("      --release_commodities=N\tsplit each release among up to N commodities (default is 1)\n");
+    printf("      --drr_quantum=N       \ttied commodities take turns releasing N packets/bytes each (default is off)\n");
+    printf("      --drr_tolerance=N     \tcommodities within N of the largest weighted differential are tied (default is 0)\n");
+    printf("      --pressure=METRIC     \tcompare backlogs, head-of-line delays or a mix of both (default is backlog)\n");
+    printf("      --pressure_mix=N      \tcount each msecond of head-of-line delay as N packets/bytes of backlog (default is 1)\n");
+    printf("      --shadow=PCT          \tdecide on shadow queues growing PCT percent faster than arrivals (default is off)\n");
+    printf("      --slot_length=US      \trelease in bursts at the start of US useconds slots of the realtime clock (default is off)\n");
+    printf("      --slot_guard=US       \twait US useconds into each slot before releasing (default is 0)\n");
 }
 
 
@@ -164,8 +318,88 @@ static void socket_init() {
 }
 
 
+/* apply a single "KEY=VALUE" option to a commodity */
+static void commodity_option(commodity_t *c, char *opt) {
+
+    char *val;
+    unsigned int ms, num;
+    struct netaddr src;
+
+    if ((val = strchr(opt, '=')) == NULL) {
+        BPRD_LOG_ERR("Error parsing commodity option: %s", opt);
+    }
+    *val++ = '\0';
+
+    if (strcmp(opt, "discipline") == 0) {
+        if (strcmp(val, "fifo") == 0) {
+            c->disc = FIFO_DISC_FIFO;
+        } else if (strcmp(val, "lifo") == 0) {
+            c->disc = FIFO_DISC_LIFO;
+        } else if (strcmp(val, "hybrid") == 0) {
+            c->disc = FIFO_DISC_HYBRID;
+        } else {
+            BPRD_LOG_ERR("Unknown commodity discipline: %s", val);
+        }
+    } else if (strcmp(opt, "deadline") == 0) {
+        if (sscanf(val, "%u", &ms) != 1) {
+            BPRD_LOG_ERR("Error parsing commodity deadline: %s", val);
+        }
+        c->deadline = ms*USEC_PER_MSEC;
+    } else if (strcmp(opt, "class") == 0) {
+        if (sscanf(val, "%u", &num) != 1) {
+            BPRD_LOG_ERR("Error parsing commodity class: %s", val);
+        }
+        c->cdata.cls = num;
+    } else if (strcmp(opt, "src") == 0) {
+        if (netaddr_from_string(&src, val) < 0 || src.type != c->cdata.addr.type) {
+            BPRD_LOG_ERR("Error parsing commodity source prefix: %s", val);
+        }
+        classifier_rule_src(&c->rule, &src);
+    } else if (strcmp(opt, "proto") == 0) {
+        if (strcmp(val, "tcp") == 0) {
+            num = IPPROTO_TCP;
+        } else if (strcmp(val, "udp") == 0) {
+            num = IPPROTO_UDP;
+        } else if (sscanf(val, "%u", &num) != 1 || num > UINT8_MAX) {
+            BPRD_LOG_ERR("Error parsing commodity protocol: %s", val);
+        }
+        c->rule.key.proto = (uint8_t)num;
+        c->rule.mask.proto = UINT8_MAX;
+    } else if (strcmp(opt, "sport") == 0 || strcmp(opt, "dport") == 0) {
+        if (sscanf(val, "%u", &num) != 1 || num > UINT16_MAX) {
+            BPRD_LOG_ERR("Error parsing commodity port: %s", val);
+        }
+        if (opt[0] == 's') {
+            c->rule.key.sport = (uint16_t)num;
+            c->rule.mask.sport = UINT16_MAX;
+        } else {
+            c->rule.key.dport = (uint16_t)num;
+            c->rule.mask.dport = UINT16_MAX;
+        }
+    } else if (strcmp(opt, "dscp") == 0) {
+        if (sscanf(val, "%u", &num) != 1 || num > 63) {
+            BPRD_LOG_ERR("Error parsing commodity DSCP: %s", val);
+        }
+        c->rule.key.dscp = (uint8_t)num;
+        c->rule.mask.dscp = 63;
+    } else if (strcmp(opt, "v") == 0) {
+        if (sscanf(val, "%u", &num) != 1) {
+            BPRD_LOG_ERR("Error parsing commodity utility weight: %s", val);
+        }
+        c->v = num;
+    } else if (strcmp(opt, "weight") == 0) {
+        if (sscanf(val, "%u", &num) != 1 || num == 0) {
+            BPRD_LOG_ERR("Error parsing commodity weight: %s", val);
+        }
+        c->weight = num;
+    } else {
+        BPRD_LOG_ERR("Unknown commodity option: %s", opt);
+    }
+}
+
+
 /* create a commodity and add to list */
-/* char *buf should be of the form "ADDRESS,ID" */
+/* char *buf should be of the form "ADDRESS,ID[,KEY=VALUE]..." */
 /* PRECONDITION: list is already initialized */
 void create_commodity(char *buf) {
 
@@ -173,9 +407,11 @@ void create_commodity(char *buf) {
     char addrstr[256];
     uint32_t nfq_id;
     commodity_t *c;
+    char *opt, *save;
+    int n = 0;
 
     /* extract fields from string */
-    if (sscanf(buf, "%[^,],%u\n", addrstr, &nfq_id) != 2) {  /* we want exactly two args processed */
+    if (sscanf(buf, "%255[^,],%u%n", addrstr, &nfq_id, &n) != 2) {  /* we want exactly two args processed */
         BPRD_LOG_ERR("Error parsing commodity string");   
     }
 
@@ -185,17 +421,53 @@ void create_commodity(char *buf) {
     if (netaddr_from_string(&c->cdata.addr, addrstr) < 0) {
         BPRD_LOG_ERR("Unable to convert string to address");
     }
+    c->cdata.cls = 0;
+    c->cdata.backlog = 0;
+    c->nfq_id = nfq_id;
+    c->queue = NULL;
+    c->disc = FIFO_DISC_FIFO;
+    c->deadline = 0;
+    c->v = 0;
+    c->weight = 1;
+    classifier_rule_init(&c->rule, &c->cdata.addr);
+
+    /* remaining fields are optional settings */
+    for (opt = strtok_r(buf+n, ", \t\n", &save); opt != NULL; opt = strtok_r(NULL, ", \t\n", &save)) {
+        commodity_option(c, opt);
+    }
+
     /* check for duplicate */
     if (clist_find(&bprd.clist, c) != NULL) {
         BPRD_LOG_ERR("Duplicate commodity detected");
     }
-    c->cdata.backlog = 0;
-    c->nfq_id = nfq_id;
-    c->queue = NULL;
+
     list_insert(&bprd.clist, c);
 }
 
 
+/* parse a comma-separated list of CPUs to pin backlogger threads to */
+/* char *buf should be of the form "CPU[,CPU]..." */
+void create_cpulist(char *buf) {
+
+    char *tok, *save;
+    int cpu;
+
+    free(bprd.backlogger_cpus);
+    bprd.backlogger_cpus = NULL;
+    bprd.backlogger_ncpus = 0;
+
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (sscanf(tok, "%d", &cpu) != 1 || cpu < 0) {
+            BPRD_LOG_ERR("Error parsing CPU list");
+        }
+        if ((bprd.backlogger_cpus = (int *)realloc(bprd.backlogger_cpus, (bprd.backlogger_ncpus+1)*sizeof(int))) == NULL) {
+            BPRD_LOG_ERR("Unable to allocate memory");
+        }
+        bprd.backlogger_cpus[bprd.backlogger_ncpus++] = cpu;
+    }
+}
+
+
 /* configuration file reading, for now supports commodity definitions only! */
 /* TODO: support full range of options! */
 /* TODO: look at i) libconfig or ii) glibc's key-value file parser */
@@ -403,6 +675,165 @@ void bprd_init(int argc, char **argv) {
             printf("update_interval option: %s\n", optarg);
             bprd.update_interval = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
             break;
+        case OPT_RELEASE_COUNT:
+            printf("release_count option: %s\n", optarg);
+            bprd.release_count = (uint32_t)atoi(optarg);
+            break;
+        case OPT_BACKLOGGER_THREADS:
+            printf("backlogger_threads option: %s\n", optarg);
+            bprd.backlogger_threads = (uint32_t)atoi(optarg);
+            break;
+        case OPT_BACKLOGGER_CPUS:
+            printf("backlogger_cpus option: %s\n", optarg);
+            create_cpulist(optarg);
+            break;
+        case OPT_RCVBUF:
+            printf("rcvbuf option: %s\n", optarg);
+            bprd.rcvbuf = (uint32_t)atoi(optarg);
+            break;
+        case OPT_NO_ENOBUFS:
+            printf("no_enobufs option\n");
+            bprd.no_enobufs = 1;
+            break;
+        case OPT_QUEUE_SIZE:
+            printf("queue_size option: %s\n", optarg);
+            bprd.queue_size = (uint32_t)atoi(optarg);
+            break;
+        case OPT_BACKLOG_UNITS:
+            printf("backlog_units option: %s\n", optarg);
+            if (strcmp(optarg, "packets") == 0) {
+                bprd.backlog_units = BPRD_UNITS_PACKETS;
+            } else if (strcmp(optarg, "bytes") == 0) {
+                bprd.backlog_units = BPRD_UNITS_BYTES;
+            } else {
+                BPRD_LOG_ERR("Unknown backlog units: %s", optarg);
+            }
+            break;
+        case OPT_AQM_TARGET:
+            printf("aqm_target option: %s\n", optarg);
+            bprd.aqm_target = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
+            break;
+        case OPT_AQM_INTERVAL:
+            printf("aqm_interval option: %s\n", optarg);
+            bprd.aqm_interval = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
+            break;
+        case OPT_MAX_BACKLOG:
+            printf("max_backlog option: %s\n", optarg);
+            bprd.max_backlog = (uint32_t)atoi(optarg);
+            break;
+        case OPT_SHARED_QUEUE:
+            printf("shared_queue option: %s\n", optarg);
+            bprd.shared_queue = (uint32_t)atoi(optarg);
+            if (bprd.shared_queues == 0) {
+                bprd.shared_queues = 1;
+            }
+            break;
+        case OPT_SHARED_QUEUES:
+            printf("shared_queues option: %s\n", optarg);
+            bprd.shared_queues = (uint32_t)atoi(optarg);
+            break;
+        case OPT_GSO:
+            printf("gso option\n");
+            bprd.gso = 1;
+            break;
+        case OPT_FAIL_OPEN:
+            printf("fail_open option\n");
+            bprd.fail_open = 1;
+            break;
+        case OPT_QUEUE_MAXLEN:
+            printf("queue_maxlen option: %s\n", optarg);
+            bprd.queue_maxlen = (uint32_t)atoi(optarg);
+            break;
+        case OPT_RECONCILE_INTERVAL:
+            printf("reconcile_interval option: %s\n", optarg);
+            bprd.reconcile_interval = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
+            break;
+        case OPT_STEERING:
+            printf("steering option: %s\n", optarg);
+            if (strcmp(optarg, "route") == 0) {
+                bprd.steering = BPRD_STEERING_ROUTE;
+            } else if (strcmp(optarg, "mark") == 0) {
+                bprd.steering = BPRD_STEERING_MARK;
+            } else {
+                BPRD_LOG_ERR("Unknown steering method: %s", optarg);
+            }
+            break;
+        case OPT_MARK_BASE:
+            printf("mark_base option: %s\n", optarg);
+            bprd.mark_base = (uint32_t)atoi(optarg);
+            break;
+        case OPT_FLOWLET_GAP:
+            printf("flowlet_gap option: %s\n", optarg);
+            bprd.flowlet_gap = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
+            break;
+        case OPT_FLOWLET_TABLE:
+            printf("flowlet_table option: %s\n", optarg);
+            bprd.flowlet_table = (uint32_t)atoi(optarg);
+            break;
+        case OPT_ECN_BACKLOG:
+            printf("ecn_backlog option: %s\n", optarg);
+            bprd.ecn_backlog = (uint32_t)atoi(optarg);
+            break;
+        case OPT_ECN_SOJOURN:
+            printf("ecn_sojourn option: %s\n", optarg);
+            bprd.ecn_sojourn = ((uint32_t)atoi(optarg))*USEC_PER_MSEC;
+            break;
+        case OPT_RELEASE_RATE:
+            printf("release_rate option: %s\n", optarg);
+            bprd.release_rate = (uint32_t)atoi(optarg);
+            break;
+        case OPT_RELEASE_BURST:
+            printf("release_burst option: %s\n", optarg);
+            bprd.release_burst = (uint32_t)atoi(optarg);
+            break;
+        case OPT_TXQ_LOW:
+            printf("txq_low option: %s\n", optarg);
+            bprd.txq_low = (uint32_t)atoi(optarg);
+            break;
+        case OPT_TXQ_HIGH:
+            printf("txq_high option: %s\n", optarg);
+            bprd.txq_high = (uint32_t)atoi(optarg);
+            break;
+        case OPT_RELEASE_COMMODITIES:
+            printf("release_commodities option: %s\n", optarg);
+            bprd.release_commodities = (uint32_t)atoi(optarg);
+            break;
+        case OPT_DRR_QUANTUM:
+            printf("drr_quantum option: %s\n", optarg);
+            bprd.drr_quantum = (uint32_t)atoi(optarg);
+            break;
+        case OPT_DRR_TOLERANCE:
+            printf("drr_tolerance option: %s\n", optarg);
+            bprd.drr_tolerance = (uint32_t)atoi(optarg);
+            break;
+        case OPT_PRESSURE:
+            printf("pressure option: %s\n", optarg);
+            if (strcmp(optarg, "backlog") == 0) {
+                bprd.pressure = BPRD_PRESSURE_BACKLOG;
+            } else if (strcmp(optarg, "hol") == 0) {
+                bprd.pressure = BPRD_PRESSURE_HOL;
+            } else if (strcmp(optarg, "mix") == 0) {
+                bprd.pressure = BPRD_PRESSURE_MIX;
+            } else {
+                BPRD_LOG_ERR("Unknown pressure metric: %s", optarg);
+            }
+            break;
+        case OPT_PRESSURE_MIX:
+            printf("pressure_mix option: %s\n", optarg);
+            bprd.pressure_mix = (uint32_t)atoi(optarg);
+            break;
+        case OPT_SHADOW:
+            printf("shadow option: %s\n", optarg);
+            bprd.shadow = (uint32_t)atoi(optarg);
+            break;
+        case OPT_SLOT_LENGTH:
+            printf("slot_length option: %s\n", optarg);
+            bprd.slot_length = (uint32_t)atoi(optarg);
+            break;
+        case OPT_SLOT_GUARD:
+            printf("slot_guard option: %s\n", optarg);
+            bprd.slot_guard = (uint32_t)atoi(optarg);
+            break;
         case '?':
             BPRD_LOG_ERR("Unable to parse input arguments");
             break;
@@ -469,17 +900,89 @@ void bprd_init(int argc, char **argv) {
         BPRD_LOG_ERR("Unable to create multicast address");
     }
 
+    /* backlogger threads */
+    if (bprd.backlogger_threads == 0) {
+        BPRD_LOG_ERR("Number of backlogger threads must be positive");
+    }
+
+    if (bprd.queue_size == 0) {
+        BPRD_LOG_ERR("Queue size must be positive");
+    }
+
+    if (bprd.shared_queue + bprd.shared_queues > UINT16_MAX + 1) {
+        BPRD_LOG_ERR("Shared queues must be numbered below %u", UINT16_MAX + 1);
+    }
+
+    if (bprd.aqm_target && bprd.aqm_interval == 0) {
+        BPRD_LOG_ERR("AQM interval must be positive");
+    }
+
+    if (bprd.steering == BPRD_STEERING_MARK && bprd.mark_base <= RT_TABLE_LOCAL) {
+        BPRD_LOG_ERR("Mark base must be above %u, the reserved routing tables", RT_TABLE_LOCAL);
+    }
+
+    if (bprd.flowlet_gap && bprd.steering != BPRD_STEERING_MARK) {
+        BPRD_LOG_ERR("Flowlets require --steering=mark");
+    }
+
+    if (bprd.release_rate && bprd.release_burst == 0) {
+        BPRD_LOG_ERR("Release burst must be positive");
+    }
+
+    if (bprd.release_commodities == 0 || bprd.release_commodities > DIFFHEAP_TOP_MAX) {
+        BPRD_LOG_ERR("Release commodities must be between 1 and %d", DIFFHEAP_TOP_MAX);
+    }
+
+    if (bprd.shadow && bprd.pressure != BPRD_PRESSURE_BACKLOG) {
+        BPRD_LOG_ERR("Shadow queues require --pressure=backlog");
+    }
+
+    if (bprd.slot_length && bprd.release_rate) {
+        BPRD_LOG_ERR("Slots cannot be combined with a release rate");
+    }
+
+    if (bprd.slot_length && bprd.slot_guard >= bprd.slot_length) {
+        BPRD_LOG_ERR("Slot guard must be shorter than the slot");
+    }
+
+    if (bprd.txq_high && bprd.release_rate) {
+        BPRD_LOG_ERR("Transmit queue watermarks cannot be combined with a release rate");
+    }
+
+    if (bprd.txq_high && bprd.txq_low > bprd.txq_high) {
+        BPRD_LOG_ERR("Transmit queue low watermark must not exceed the high watermark");
+    }
+
+    if (!bprd.release_rate && !bprd.slot_length && bprd.release_interval == 0) {
+        BPRD_LOG_ERR("Release interval must be positive");
+    }
+
+    if (bprd.flowlet_table == 0) {
+        BPRD_LOG_ERR("Flowlet table size must be positive");
+    }
+
     /* timers */
     bprd.neighbor_timeout = bprd.hello_interval * BPRD_DEFAULT_NEIGHBOR_TIMEOUT;
 
     /* verify existing commodity list up to this point is of the correct type */
-    elm_t *e;
+    elm_t *e, *f;
     commodity_t *com;
+    struct netaddr_str nbuf;
     for(e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
         com = (commodity_t *)e->data;
         if (com->cdata.addr.type != bprd.ipver) {
             BPRD_LOG_ERR("Commodity destination IP address version does not match program's IP version");      
         }
+        if (!bprd.shared_queues && !classifier_rule_dst_only(&com->rule)) {
+            BPRD_LOG_ERR("Commodities matching more than their destination require --shared_queue");
+        }
+        /* packets are steered to a commodity by its rule alone, the class does not tell commodities apart */
+        for (f = LIST_NEXT(e, elms); f != NULL; f = LIST_NEXT(f, elms)) {
+            if (classifier_rule_equal(&com->rule, &((commodity_t *)f->data)->rule)) {
+                BPRD_LOG_ERR("Commodities to %s match the same packets, give them distinct src/proto/port options",
+                             netaddr_to_string(&nbuf, &com->cdata.addr));
+            }
+        }
         /** \todo Verify uniqueness of nfq_id on each commodity. */
     }
 }
@@ -516,14 +1019,7 @@ int main(int argc, char **argv) {
 
     /* just hang out here for a while */
     /* this 'thread' periodically releases data packets to kernel */
-    while(1) {
-
-        /* release a packet */
-        backlogger_packet_release(1);
-        /* wait prescribed time */
-        /** \todo change to nanosleep */
-        usleep(bprd.release_interval);
-    }
+    scheduler_run();
 
     /* close socket and get out of here */
     close(bprd.sockfd);
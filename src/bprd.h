@@ -32,6 +32,16 @@
 #define BPRD_DEFAULT_RELEASE_INTERVAL 100   /* mseconds */
 #define BPRD_DEFAULT_UPDATE_INTERVAL 100    /* mseconds */
 #define BPRD_DEFAULT_NEIGHBOR_TIMEOUT 5     /* # of missed hello messages */
+#define BPRD_DEFAULT_RELEASE_COUNT 1        /* packets per release interval */
+#define BPRD_DEFAULT_BACKLOGGER_THREADS 1   /* # of backlogger threads */
+#define BPRD_DEFAULT_RCVBUF (4*1024*1024)   /* bytes */
+#define BPRD_DEFAULT_QUEUE_SIZE 1024        /* packets per commodity */
+#define BPRD_DEFAULT_AQM_INTERVAL 100       /* mseconds */
+#define BPRD_DEFAULT_RECONCILE_INTERVAL 1000 /* mseconds */
+#define BPRD_DEFAULT_MARK_BASE 1000         /* first firewall mark and routing table */
+#define BPRD_DEFAULT_FLOWLET_TABLE 4096     /* flows tracked */
+#define BPRD_DEFAULT_RELEASE_BURST 8        /* packets */
+#define BPRD_DEFAULT_PRESSURE_MIX 1         /* backlog units per msecond */
 
 /**< \todo Move this into a config.h. */
 #define BPRD_DEFAULT_PIDLEN 25
@@ -40,11 +50,22 @@
 /**< \todo Move this into a config.h. */
 #define BPRD_DEFAULT_CONSTR "/etc/bprd.conf"
 
+#define BPRD_UNITS_PACKETS 0                /* backlogs measured in packets */
+#define BPRD_UNITS_BYTES 1                  /* backlogs measured in bytes */
+
+#define BPRD_STEERING_ROUTE 0               /* commodity routes rewritten in the main table */
+#define BPRD_STEERING_MARK 1                /* packets marked for their next hop's table */
+
+#define BPRD_PRESSURE_BACKLOG 0             /* backpressure from queue lengths */
+#define BPRD_PRESSURE_HOL 1                 /* backpressure from head-of-line delays */
+#define BPRD_PRESSURE_MIX 2                 /* backpressure from both */
+
 #define BPRD_MSG_TYPE_HELLO 1
 
 #define BPRD_MSGTLV_TYPE_COM 1
 #define BPRD_MSGTLV_TYPE_COMKEY 2
 #define BPRD_MSGTLV_TYPE_BACKLOG 3
+#define BPRD_MSGTLV_TYPE_COMEXT 4
 
 
 /** 
@@ -81,11 +102,46 @@ typedef struct bprd {
     uint32_t release_interval;  /**< Time period between releasing packets (useconds). */
     uint32_t update_interval;   /**< Time period between updating next hop routes (useconds). */
     uint32_t neighbor_timeout;   /**< Time period (useconds). */
+    uint32_t release_count;     /**< Maximum number of packets released every \a release_interval. */
    
     /* commodity table */
     list_t clist;               /**< Commodity list. */
     /** \todo Determine if a mutex is needed for the commodity list. */
-    pthread_t backlogger_tid;   /**< ID of the backlogger thread. */
+    pthread_t *backlogger_tid;  /**< IDs of the backlogger threads. */
+    uint32_t backlogger_threads; /**< Number of backlogger threads, each with its own netlink socket. */
+    int *backlogger_cpus;       /**< CPUs to pin backlogger threads to, assigned in round-robin order. */
+    uint32_t backlogger_ncpus;  /**< Number of CPUs in \a backlogger_cpus, 0 if threads are not pinned. */
+    uint32_t rcvbuf;            /**< Receive buffer size of each backlogger netlink socket (bytes), 0 for kernel default. */
+    int no_enobufs;             /**< Boolean integer indicating if backlogger sockets suppress ENOBUFS reports. */
+    uint32_t queue_size;        /**< Number of packets tracked per commodity, rounded up to a power of two. */
+    int backlog_units;          /**< Units of backlog differentials, BPRD_UNITS_PACKETS or BPRD_UNITS_BYTES. */
+    uint32_t aqm_target;        /**< Sojourn time tolerated before AQM drops (useconds), zero disables the AQM. */
+    uint32_t aqm_interval;      /**< Time sojourn must exceed \a aqm_target before AQM drops start (useconds). */
+    uint32_t shared_queue;      /**< First netfilter queue shared by all commodities, only if \a shared_queues. */
+    uint32_t shared_queues;     /**< Number of shared netfilter queues, zero gives each commodity its own queue. */
+    uint32_t max_backlog;       /**< Packets held per commodity before arrivals are dropped, zero for \a queue_size. */
+    int gso;                    /**< Boolean integer indicating if GSO packets are queued whole. */
+    int fail_open;              /**< Boolean integer indicating if packets are accepted rather than dropped when queues are full. */
+    uint32_t queue_maxlen;      /**< Packets held by the kernel per netfilter queue, zero for kernel default. */
+    uint32_t reconcile_interval; /**< Time period between reconciling backlogs with the kernel (useconds), zero disables. */
+    int steering;               /**< How packets reach their next hop, BPRD_STEERING_ROUTE or BPRD_STEERING_MARK. */
+    uint32_t mark_base;         /**< First firewall mark and routing table given to neighbors under BPRD_STEERING_MARK. */
+    uint32_t flowlet_gap;       /**< Idle time after which a flow may change next hop (useconds), zero disables flowlets. */
+    uint32_t flowlet_table;     /**< Number of flows tracked for flowlets, rounded up to a power of two. */
+    uint32_t ecn_backlog;       /**< Commodity backlog (segments) at which released packets are marked CE, zero disables. */
+    uint32_t ecn_sojourn;       /**< Time queued at which released packets are marked CE (useconds), zero disables. */
+    uint32_t release_rate;      /**< Packets released per second, zero releases \a release_count every \a release_interval. */
+    uint32_t release_burst;     /**< Packets the release rate's token bucket holds. */
+    uint32_t txq_low;           /**< Transmit queue length below which releasing starts (packets). */
+    uint32_t txq_high;          /**< Transmit queue length at which releasing stops (packets), zero disables. */
+    uint32_t release_commodities; /**< Maximum number of commodities released from per release. */
+    uint32_t drr_quantum;       /**< Credit per deficit round-robin turn of tied commodities, zero disables. */
+    uint32_t drr_tolerance;     /**< Weighted differentials within this of the largest are tied. */
+    int pressure;               /**< What backlogs measure, BPRD_PRESSURE_BACKLOG, BPRD_PRESSURE_HOL or BPRD_PRESSURE_MIX. */
+    uint32_t pressure_mix;      /**< Backlog units added per msecond of head-of-line delay under BPRD_PRESSURE_MIX. */
+    uint32_t shadow;            /**< Percentage by which shadow queues outgrow arrivals, zero disables shadow queues. */
+    uint32_t slot_length;       /**< Length of the realtime clock slots packets are released in (useconds), zero disables. */
+    uint32_t slot_guard;        /**< Time at the start of each slot in which nothing is released (useconds). */
     pthread_t router_tid;       /**< ID of the router thread. */
 
     /* neighbor table */
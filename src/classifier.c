@@ -0,0 +1,365 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup classifier Classifier
+ * This module maps packets onto commodities by their destination and, optionally, their source prefix, protocol,
+ * ports and DSCP.
+ *
+ * Rules are grouped by the fields they match on (their mask) into tuples, and each tuple keeps its rules in an avl
+ * tree keyed by the masked fields.  A packet is classified by masking its fields with each tuple's mask in turn and
+ * looking the result up, most specific tuple first, so the cost grows with the number of distinct masks and only
+ * logarithmically with the number of commodities.
+ * \{
+ */
+
+#include "classifier.h"
+
+#include <assert.h>         /* for assert() */
+#include <netinet/in.h>     /* for IPPROTO_*, AF_INET* */
+#include <stdlib.h>         /* for calloc(), realloc() */
+#include <string.h>         /* for memcmp(), memset() */
+
+#include "commodity.h"
+
+
+/**
+ * \struct classifier_key
+ * Packet fields a commodity may be defined by.  Ports are held in host byte order.
+ * \var classifier_key::dst
+ * Destination address.
+ * \var classifier_key::src
+ * Source address.
+ * \var classifier_key::sport
+ * Source port of TCP, UDP, UDP-Lite or SCTP packets.
+ * \var classifier_key::dport
+ * Destination port of TCP, UDP, UDP-Lite or SCTP packets.
+ * \var classifier_key::proto
+ * IP protocol number, the IPv6 next header.
+ * \var classifier_key::dscp
+ * Differentiated services code point.
+ */
+
+
+/**
+ * \struct classifier_rule
+ * Packets whose fields, masked by \a mask, equal \a key.
+ * \var classifier_rule::key
+ * Values of the matched fields, zero where \a mask is zero.
+ * \var classifier_rule::mask
+ * Bits of the packet fields that are matched.
+ */
+
+
+/**
+ * \struct classifier_tuple
+ * Rules sharing one mask.
+ * \var classifier_tuple::mask
+ * Mask of every rule in \a tree.
+ * \var classifier_tuple::bits
+ * Number of bits set in \a mask, tuples with more are tried first.
+ * \var classifier_tuple::tree
+ * Commodities keyed by classifier_rule::key.
+ */
+
+
+/**
+ * \struct classifier
+ * Compiled set of commodity rules.
+ * \var classifier::tuples
+ * Tuples in order of decreasing specificity.
+ * \var classifier::ntuples
+ * Number of tuples.
+ */
+
+
+/**
+ * Avl comparator of classifier keys.
+ */
+static int classifier_keycmp(const void *k1, const void *k2, void *ptr __attribute__((unused))) {
+
+    return memcmp(k1, k2, sizeof(classifier_key_t));
+}
+
+
+/**
+ * Mask the fields of a key.
+ *
+ * \param dst Masked key.
+ * \param key Key.
+ * \param mask Mask.
+ */
+static void classifier_mask(classifier_key_t *dst, const classifier_key_t *key, const classifier_key_t *mask) {
+
+    const uint8_t *k = (const uint8_t *)key, *m = (const uint8_t *)mask;
+    uint8_t *d = (uint8_t *)dst;
+    size_t i;
+
+    for (i = 0; i < sizeof(classifier_key_t); i++) {
+        d[i] = k[i] & m[i];
+    }
+}
+
+
+/**
+ * Set the leading \a bits bits of a mask.
+ *
+ * \param mask The mask.
+ * \param bits Number of bits to set.
+ */
+static void classifier_prefix(uint8_t *mask, uint8_t bits) {
+
+    uint8_t i;
+
+    for (i = 0; i < bits / 8; i++) {
+        mask[i] = 0xff;
+    }
+    if (bits % 8) {
+        mask[i] = (uint8_t)(0xff << (8 - bits % 8));
+    }
+}
+
+
+/**
+ * Read the fields of a packet from its IP header.
+ *
+ * Ports are only read from unfragmented packets, or the first fragment, of protocols that carry them.  IPv6 extension
+ * headers are not followed, so the protocol of such packets is that of their first extension header.
+ *
+ * \param key Set to the fields of the packet.
+ * \param pkt Start of the IP header.
+ * \param len Number of bytes available at \a pkt.
+ * \param family Address family of the packet.
+ *
+ * \retval 0 On success.
+ * \retval -1 If the packet is too short.
+ */
+int classifier_parse(classifier_key_t *key, const uint8_t *pkt, int len, int family) {
+
+    int hlen;
+
+    memset(key, 0, sizeof(*key));
+
+    if (family == AF_INET6) {
+        if (len < 40) {
+            return -1;
+        }
+        hlen = 40;
+        key->dscp = (uint8_t)(((pkt[0] & 0x0f) << 2) | (pkt[1] >> 6));
+        key->proto = pkt[6];
+        memcpy(key->src, pkt + 8, 16);
+        memcpy(key->dst, pkt + 24, 16);
+    } else {
+        if (len < 20) {
+            return -1;
+        }
+        hlen = (pkt[0] & 0x0f) * 4;
+        key->dscp = pkt[1] >> 2;
+        key->proto = pkt[9];
+        memcpy(key->src, pkt + 12, 4);
+        memcpy(key->dst, pkt + 16, 4);
+
+        if (((pkt[6] & 0x1f) | pkt[7]) != 0) {
+            /* not the first fragment, no ports */
+            return 0;
+        }
+    }
+
+    switch (key->proto) {
+        case IPPROTO_TCP:
+        case IPPROTO_UDP:
+        case IPPROTO_UDPLITE:
+        case IPPROTO_SCTP:
+            if (len >= hlen + 4) {
+                key->sport = (uint16_t)((pkt[hlen] << 8) | pkt[hlen + 1]);
+                key->dport = (uint16_t)((pkt[hlen + 2] << 8) | pkt[hlen + 3]);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Initialize a rule matching every packet to a destination.
+ *
+ * \param r The rule.
+ * \param dst Destination address.
+ */
+void classifier_rule_init(classifier_rule_t *r, struct netaddr *dst) {
+
+    assert(r && dst);
+
+    memset(r, 0, sizeof(*r));
+    memcpy(r->key.dst, dst->addr, sizeof(r->key.dst));
+    classifier_prefix(r->mask.dst, dst->type == AF_INET6 ? 128 : 32);
+}
+
+
+/**
+ * Restrict a rule to packets from a source prefix.
+ *
+ * \param r The rule.
+ * \param src Source prefix.
+ */
+void classifier_rule_src(classifier_rule_t *r, struct netaddr *src) {
+
+    size_t i;
+
+    assert(r && src);
+
+    memset(r->mask.src, 0, sizeof(r->mask.src));
+    classifier_prefix(r->mask.src, src->prefix_len);
+    for (i = 0; i < sizeof(r->key.src); i++) {
+        r->key.src[i] = src->addr[i] & r->mask.src[i];
+    }
+}
+
+
+/**
+ * Check if a rule matches on nothing but the destination.
+ *
+ * \param r The rule.
+ *
+ * \returns Boolean integer indicating if only the destination is matched.
+ */
+int classifier_rule_dst_only(classifier_rule_t *r) {
+
+    classifier_key_t mask;
+
+    assert(r);
+
+    memset(&mask, 0, sizeof(mask));
+    memcpy(mask.dst, r->mask.dst, sizeof(mask.dst));
+
+    return memcmp(&mask, &r->mask, sizeof(mask)) == 0;
+}
+
+
+/**
+ * Check if two rules match the same packets.
+ *
+ * \param a A rule.
+ * \param b Another rule.
+ *
+ * \returns Boolean integer indicating if the rules have the same key and mask.
+ */
+int classifier_rule_equal(classifier_rule_t *a, classifier_rule_t *b) {
+
+    assert(a && b);
+
+    return memcmp(&a->key, &b->key, sizeof(a->key)) == 0 && memcmp(&a->mask, &b->mask, sizeof(a->mask)) == 0;
+}
+
+
+/**
+ * Initialize an empty classifier.
+ *
+ * \param cl The classifier.
+ */
+void classifier_init(classifier_t *cl) {
+
+    assert(cl);
+
+    cl->tuples = NULL;
+    cl->ntuples = 0;
+}
+
+
+/**
+ * Add a commodity to a classifier.
+ *
+ * \param cl The classifier.
+ * \param c The commodity, whose \a rule must not change while it is in \a cl.
+ *
+ * \retval 0 On success.
+ * \retval -1 If another commodity has the same rule, or on error.
+ */
+int classifier_add(classifier_t *cl, commodity_t *c) {
+
+    classifier_tuple_t *t, **tuples;
+    const uint8_t *m;
+    uint32_t i, j;
+
+    assert(cl && c);
+
+    for (i = 0; i < cl->ntuples; i++) {
+        if (memcmp(&cl->tuples[i]->mask, &c->rule.mask, sizeof(classifier_key_t)) == 0) {
+            break;
+        }
+    }
+
+    if (i == cl->ntuples) {
+        /* first rule with this mask */
+        if ((t = (classifier_tuple_t *)calloc(1, sizeof(classifier_tuple_t))) == NULL) {
+            return -1;
+        }
+        if ((tuples = (classifier_tuple_t **)realloc(cl->tuples, (cl->ntuples + 1) * sizeof(*tuples))) == NULL) {
+            free(t);
+            return -1;
+        }
+        cl->tuples = tuples;
+
+        t->mask = c->rule.mask;
+        for (m = (const uint8_t *)&t->mask, j = 0; j < sizeof(classifier_key_t); j++) {
+            t->bits += (uint32_t)__builtin_popcount(m[j]);
+        }
+        avl_init(&t->tree, classifier_keycmp, false, NULL);
+
+        /* keep the most specific tuples first */
+        for (i = cl->ntuples; i > 0 && cl->tuples[i - 1]->bits < t->bits; i--) {
+            cl->tuples[i] = cl->tuples[i - 1];
+        }
+        cl->tuples[i] = t;
+        cl->ntuples++;
+    }
+
+    c->node.key = &c->rule.key;
+
+    return avl_insert(&cl->tuples[i]->tree, &c->node);
+}
+
+
+/**
+ * Find the commodity of a packet.
+ *
+ * \param cl The classifier.
+ * \param pkt Start of the packet's IP header.
+ * \param len Number of bytes available at \a pkt.
+ * \param family Address family of the packet.
+ *
+ * \returns The commodity of the most specific rule matching the packet.
+ * \retval NULL If no rule matches.
+ */
+commodity_t *classifier_lookup(classifier_t *cl, const uint8_t *pkt, int len, int family) {
+
+    classifier_key_t key, masked;
+    commodity_t *c = NULL;
+    uint32_t i;
+
+    if (classifier_parse(&key, pkt, len, family) < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < cl->ntuples; i++) {
+        classifier_mask(&masked, &key, &cl->tuples[i]->mask);
+        if ((c = avl_find_element(&cl->tuples[i]->tree, &masked, c, node)) != NULL) {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+/** \} */
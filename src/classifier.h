@@ -0,0 +1,56 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __CLASSIFIER_H
+#define __CLASSIFIER_H
+
+#include <stdint.h>             /* for uint*_t */
+
+#include <common/avl.h>         /* for struct avl_tree */
+#include <common/netaddr.h>     /* for struct netaddr */
+
+struct commodity;
+
+typedef struct classifier_key {
+    uint8_t dst[16];
+    uint8_t src[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t dscp;
+} classifier_key_t;
+
+typedef struct classifier_rule {
+    classifier_key_t key;
+    classifier_key_t mask;
+} classifier_rule_t;
+
+typedef struct classifier_tuple {
+    classifier_key_t mask;
+    uint32_t bits;
+    struct avl_tree tree;
+} classifier_tuple_t;
+
+typedef struct classifier {
+    classifier_tuple_t **tuples;
+    uint32_t ntuples;
+} classifier_t;
+
+extern int classifier_parse(classifier_key_t *key, const uint8_t *pkt, int len, int family);
+extern void classifier_rule_init(classifier_rule_t *r, struct netaddr *dst);
+extern void classifier_rule_src(classifier_rule_t *r, struct netaddr *src);
+extern int classifier_rule_dst_only(classifier_rule_t *r);
+extern int classifier_rule_equal(classifier_rule_t *a, classifier_rule_t *b);
+extern void classifier_init(classifier_t *cl);
+extern int classifier_add(classifier_t *cl, struct commodity *c);
+extern struct commodity *classifier_lookup(classifier_t *cl, const uint8_t *pkt, int len, int family);
+
+#endif /* __CLASSIFIER_H */
@@ -21,6 +21,7 @@
 
 #include "common/netaddr.h"     /* for netaddr_cmp() */
 
+#include "bprd.h"
 #include "list.h"
 
 
@@ -29,8 +30,36 @@
  * Data structure containing commodity fields essential for sharing.
  * \var commodity_short::addr
  * Destination address of the commodity.
+ * \var commodity_short::cls
+ * Class distinguishing commodities to the same destination, zero unless configured.
  * \var commodity_short::backlog
- * Backlog associated with the commodity.
+ * Backlog associated with the commodity (packets, GSO packets count as their number of segments).
+ * \var commodity_short::backlog_bytes
+ * Backlog associated with the commodity (bytes).
+ * \var commodity_short::hol
+ * Time the oldest packet of the commodity has waited (useconds).
+ */
+
+
+/**
+ * \struct commodity_basic
+ * Commodity fields as hellos carried them before commodity_short grew, sent in BPRD_MSGTLV_TYPE_COM TLVs so that
+ * nodes running older versions still read them.  Commodities needing the other fields are sent whole in
+ * BPRD_MSGTLV_TYPE_COMEXT TLVs instead.
+ * \var commodity_basic::addr
+ * Destination address of the commodity.
+ * \var commodity_basic::backlog
+ * Backlog associated with the commodity (packets).
+ */
+
+
+/**
+ * \struct commodity_hop
+ * A neighbor a commodity can be released to under BPRD_STEERING_MARK (\see router_mark).
+ * \var commodity_hop::mark
+ * Firewall mark routing packets to the neighbor.
+ * \var commodity_hop::backlog
+ * The neighbor's backlog of the commodity, in the units of bprd.backlog_units.
  */
 
 
@@ -40,11 +69,46 @@
  * \var commodity::cdata
  * Essential commodity fields encapsulated in a data structure.
  * \var commodity::backdiff
- * Backlog differential of commodity.
+ * Backlog differential of commodity, in the units of bprd.backlog_units.
  * \var commodity::nfq_id
  * NFQUEUE ID associated with this commodity (\see backlogger)
  * \var commodity::queue
  * Queue holding packets of this commodity (\see fifo_queue)
+ * \var commodity::disc
+ * Order in which packets of this commodity are released (\see fifo_queue)
+ * \var commodity::deadline
+ * Age beyond which a FIFO_DISC_HYBRID commodity releases its oldest packet (useconds).
+ * \var commodity::v
+ * Utility weight of admitting locally originated packets, in the units of bprd.backlog_units, zero admits all of them
+ * (\see fifo_set_admission).
+ * \var commodity::weight
+ * Weight of the commodity's backlog differential when choosing which commodity to release (\see backlogger).
+ * \var commodity::heap
+ * Position of the commodity in the differential heap (\see diffheap).
+ * \var commodity::tie
+ * Entry in the list of commodities tied for the largest differential, in the order they take turns (\see diffheap).
+ * \var commodity::tied
+ * Whether the commodity is in the tie list.
+ * \var commodity::tie_joined
+ * Set when the commodity joins the tie list, cleared once diffheap_turn() has wiped its deficit for the new tie.
+ * \var commodity::deficit
+ * Deficit round-robin credit of the commodity while tied for the largest differential, in the units of
+ * bprd.backlog_units, only used by the releasing thread (\see backlogger).
+ * \var commodity::hops_seq
+ * Sequence count of the seqlock guarding nhops, hop_dest and hops, odd while they are being written (\see router).
+ * \var commodity::nhops
+ * Number of neighbors in hops.
+ * \var commodity::hop_dest
+ * Mark of the neighbor that is the commodity's destination, zero if it is not a neighbor.
+ * \var commodity::hops
+ * Neighbors the commodity can be released to under BPRD_STEERING_MARK, the COMMODITY_HOPS_MAX with the lowest
+ * backlogs.
+ * \var commodity::hop_turn
+ * Rotates which of the neighbors tied for the lowest backlog is picked, only used by the releasing thread.
+ * \var commodity::rule
+ * Packets belonging to this commodity (\see classifier).
+ * \var commodity::node
+ * Node keyed by rule.key in the classifier used for packets arriving on shared netfilter queues.
  */
 
 
@@ -93,7 +157,9 @@ static int cmp_data_c(void *data1, void *data2) {
     commodity_t *c1 = (commodity_t *)data1;
     commodity_t *c2 = (commodity_t *)data2;
 
-    return netaddr_cmp(&c1->cdata.addr, &c2->cdata.addr); 
+    int cmp = netaddr_cmp(&c1->cdata.addr, &c2->cdata.addr);
+
+    return cmp ? cmp : (c1->cdata.cls > c2->cdata.cls) - (c1->cdata.cls < c2->cdata.cls);
 }
 
 
@@ -114,4 +180,32 @@ commodity_t *clist_find(list_t *l, commodity_t *c) {
     return e ? (commodity_t *)e->data : NULL;
 }
 
+/**
+ * Backlog of a commodity in the units backpressure decisions are made in.
+ *
+ * Under BPRD_PRESSURE_HOL the backlog is the head-of-line delay of the commodity, and under BPRD_PRESSURE_MIX the
+ * queue length plus bprd.pressure_mix units for every millisecond of head-of-line delay.
+ *
+ * \param c Commodity.
+ *
+ * \returns Backlog in packets or bytes, according to bprd.backlog_units, or in useconds, according to bprd.pressure.
+ */
+uint32_t commodity_backlog(commodity_t *c) {
+
+    uint64_t backlog;
+
+    assert(c);
+
+    if (bprd.pressure == BPRD_PRESSURE_HOL) {
+        return c->cdata.hol;
+    }
+
+    backlog = (bprd.backlog_units == BPRD_UNITS_BYTES) ? c->cdata.backlog_bytes : c->cdata.backlog;
+    if (bprd.pressure == BPRD_PRESSURE_MIX) {
+        backlog += (uint64_t)c->cdata.hol * bprd.pressure_mix / USEC_PER_MSEC;
+    }
+
+    return (backlog > UINT32_MAX) ? UINT32_MAX : (uint32_t)backlog;
+}
+
 /** \} */
@@ -13,26 +13,61 @@
 #define __COMMODITY_H
 
 #include <stdint.h>             /* for uint*_t */
+#include <sys/queue.h>          /* for TAILQ_ENTRY() */
 
+#include <common/avl.h>         /* for struct avl_node */
 #include <common/netaddr.h>     /* for struct netaddr */
 
+#include "classifier.h"
 #include "fifo_queue.h"
 #include "list.h"
 
 typedef struct commodity_short {
         struct netaddr addr;
+        uint32_t cls;
         uint32_t backlog;
+        uint32_t backlog_bytes;
+        uint32_t hol;
 } commodity_s_t;
 
+typedef struct commodity_basic {
+        struct netaddr addr;
+        uint32_t backlog;
+} commodity_b_t;
+
+#define COMMODITY_HOPS_MAX 16
+
+typedef struct commodity_hop {
+        uint32_t mark;
+        uint32_t backlog;
+} commodity_hop_t;
+
 typedef struct commodity {
     commodity_s_t cdata;
     uint32_t backdiff;
     uint16_t nfq_id;
     fifo_t *queue;
+    fifo_disc_t disc;
+    uint32_t deadline;
+    uint32_t v;
+    uint32_t weight;
+    uint32_t heap;
+    TAILQ_ENTRY(commodity) tie;
+    int tied;
+    int tie_joined;
+    int64_t deficit;
+    uint32_t hops_seq;
+    uint32_t nhops;
+    uint32_t hop_dest;
+    commodity_hop_t hops[COMMODITY_HOPS_MAX];
+    uint32_t hop_turn;
+    classifier_rule_t rule;
+    struct avl_node node;
 } commodity_t;
 
 extern void clist_free(list_t *l);
 extern commodity_t *clist_find(list_t *l, commodity_t *c);
 extern void clist_print(list_t *l);
+extern uint32_t commodity_backlog(commodity_t *c);
 
 #endif /* __COMMODITY_H */
@@ -0,0 +1,371 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup diffheap Differential Heap
+ * This module keeps the commodities in a binary max-heap keyed by their weighted backlog differentials.
+ *
+ * The router thread updates a commodity's differential in O(log C) whenever it recomputes it, and the releasing thread
+ * picks the n commodities to release from without looking past the top O(n) entries.  The differentials are copied
+ * into the heap under its mutex, so the releasing thread never reads commodity::backdiff while the router thread
+ * writes it.
+ *
+ * Commodities whose weighted differential is within a tolerance of the largest are tied, and are kept in a list in the
+ * order they take deficit round-robin turns.  The router thread updates the list as it sets differentials, so the
+ * releasing thread takes and rotates turns in O(1) (\see diffheap_turn).
+ * \{
+ */
+
+#include "diffheap.h"
+
+#include <pthread.h>        /* for pthread_mutex_*() */
+#include <stdlib.h>         /* for calloc(), free() */
+#include <sys/queue.h>      /* for LIST_*(), TAILQ_*() */
+
+#include "logger.h"
+
+
+typedef struct diffheap_node {
+    commodity_t *c;
+    uint32_t diff;
+    uint64_t key;
+} diffheap_node_t;
+
+/**
+ * \struct diffheap_node
+ * Entry of the differential heap.
+ * \var diffheap_node::c
+ * Commodity of the entry, whose commodity::heap is the entry's position.
+ * \var diffheap_node::diff
+ * Backlog differential of the commodity, as last set by the router thread.
+ * \var diffheap_node::key
+ * Differential times commodity::weight, by which entries are ordered.
+ */
+
+
+static diffheap_node_t *heap = NULL;    /**< Entries, the largest key first. */
+static uint32_t heap_len = 0;           /**< Number of entries. */
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, commodity) ties = TAILQ_HEAD_INITIALIZER(ties);    /**< Tied commodities, next turn first. */
+static uint32_t ties_len = 0;           /**< Number of tied commodities. */
+static uint32_t tolerance = 0;          /**< Weighted differential below the largest down to which commodities are tied. */
+
+
+/**
+ * Swap two entries, keeping the commodities' positions up to date.
+ */
+static void diffheap_swap(uint32_t i, uint32_t j) {
+
+    diffheap_node_t tmp = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i].c->heap = i;
+    heap[j].c->heap = j;
+}
+
+
+/**
+ * Restore the heap order around an entry whose key changed.
+ *
+ * \param i Position of the entry.
+ */
+static void diffheap_sift(uint32_t i) {
+
+    uint32_t l, r, m;
+
+    /* up */
+    while (i > 0 && heap[(i - 1) / 2].key < heap[i].key) {
+        diffheap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    /* down */
+    while (1) {
+        l = 2 * i + 1;
+        r = l + 1;
+        m = i;
+        if (l < heap_len && heap[l].key > heap[m].key) {
+            m = l;
+        }
+        if (r < heap_len && heap[r].key > heap[m].key) {
+            m = r;
+        }
+        if (m == i) {
+            break;
+        }
+        diffheap_swap(i, m);
+        i = m;
+    }
+}
+
+
+/**
+ * Initialize the heap with every commodity of a list, all with a zero differential.  Must be called before the
+ * router and releasing threads start.
+ *
+ * \param clist Commodities to release from.
+ * \param tol Weighted differential below the largest down to which commodities are tied.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+int diffheap_init(list_t *clist, uint32_t tol) {
+
+    elm_t *e;
+    uint32_t n = 0;
+
+    for (e = LIST_FIRST(clist); e != NULL; e = LIST_NEXT(e, elms)) {
+        n++;
+    }
+
+    if ((heap = (diffheap_node_t *)calloc(n ? n : 1, sizeof(diffheap_node_t))) == NULL) {
+        return -1;
+    }
+
+    for (e = LIST_FIRST(clist); e != NULL; e = LIST_NEXT(e, elms)) {
+        heap[heap_len].c = (commodity_t *)e->data;
+        heap[heap_len].c->heap = heap_len;
+        heap[heap_len].c->tied = 0;
+        heap_len++;
+    }
+    tolerance = tol;
+
+    return 0;
+}
+
+
+/**
+ * Add a commodity to the end of the tie list, unless it is in it.
+ */
+static void diffheap_tie(commodity_t *c) {
+
+    if (!c->tied) {
+        TAILQ_INSERT_TAIL(&ties, c, tie);
+        c->tied = 1;
+        c->tie_joined = 1;
+        ties_len++;
+    }
+}
+
+
+/**
+ * Remove a commodity from the tie list, if it is in it.
+ */
+static void diffheap_untie(commodity_t *c) {
+
+    if (c->tied) {
+        TAILQ_REMOVE(&ties, c, tie);
+        c->tied = 0;
+        ties_len--;
+    }
+}
+
+
+/**
+ * Add the commodities whose key is at least \a floor, below and including the entry at \a pos, to the tie list.
+ * Entries below one under the floor are all under it, so only the tied entries and their children are visited.
+ */
+static void diffheap_tie_from(uint32_t pos, uint64_t floor) {
+
+    if (pos >= heap_len || heap[pos].key < floor) {
+        return;
+    }
+
+    diffheap_tie(heap[pos].c);
+    diffheap_tie_from(2 * pos + 1, floor);
+    diffheap_tie_from(2 * pos + 2, floor);
+}
+
+
+/**
+ * Set the backlog differential of a commodity.  Only to be called from the router thread.
+ *
+ * The commodity joins or leaves the tie list.  When the largest key changes, so does the floor of the tie, and the
+ * list is brought up to date with it: a larger key drops the commodities now under the floor, a smaller one adds those
+ * now above it.  Only tied commodities are visited either way.
+ *
+ * \param c Commodity, which must be in the heap.
+ * \param diff Backlog differential of the commodity.
+ */
+void diffheap_update(commodity_t *c, uint32_t diff) {
+
+    commodity_t *t, *next;
+    uint64_t top, floor;
+
+    if (pthread_mutex_lock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to lock differential heap mutex");
+    }
+
+    top = heap[0].key;
+    heap[c->heap].diff = diff;
+    heap[c->heap].key = (uint64_t)diff * c->weight;
+    diffheap_sift(c->heap);
+
+    /* commodities with a zero differential are never tied */
+    floor = (heap[0].key > tolerance) ? heap[0].key - tolerance : 1;
+    if (heap[0].key > top) {
+        for (t = TAILQ_FIRST(&ties); t != NULL; t = next) {
+            next = TAILQ_NEXT(t, tie);
+            if (heap[t->heap].key < floor) {
+                diffheap_untie(t);
+            }
+        }
+    } else if (heap[0].key < top) {
+        diffheap_tie_from(0, floor);
+    }
+
+    if (heap[c->heap].key >= floor) {
+        diffheap_tie(c);
+    } else {
+        diffheap_untie(c);
+    }
+
+    if (pthread_mutex_unlock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to unlock differential heap mutex");
+    }
+}
+
+
+/**
+ * Returns the commodities with the largest weighted backlog differentials, largest first.
+ *
+ * The heap is walked best first from its root, which visits O(n) entries whatever the number of commodities.
+ *
+ * \param c Filled with up to DIFFHEAP_TOP_MAX commodities.
+ * \param diff Filled with the commodities' (unweighted) backlog differentials.
+ * \param n Number of commodities to return, if that many have a positive differential.
+ *
+ * \return Number of commodities returned, all with a positive differential.
+ */
+uint32_t diffheap_top(commodity_t **c, uint32_t *diff, uint32_t n) {
+
+    uint32_t cand[DIFFHEAP_TOP_MAX + 1];    /* heap positions whose parents were returned */
+    uint32_t ncand = 0, found = 0;
+    uint32_t i, best, pos;
+
+    n = (n > DIFFHEAP_TOP_MAX) ? DIFFHEAP_TOP_MAX : n;
+
+    if (pthread_mutex_lock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to lock differential heap mutex");
+    }
+
+    if (heap_len > 0) {
+        cand[ncand++] = 0;
+    }
+
+    while (found < n && ncand > 0) {
+        /* take the best candidate, every entry below it is no larger */
+        best = 0;
+        for (i = 1; i < ncand; i++) {
+            if (heap[cand[i]].key > heap[cand[best]].key) {
+                best = i;
+            }
+        }
+        pos = cand[best];
+        cand[best] = cand[--ncand];
+
+        if (heap[pos].key == 0) {
+            break;
+        }
+        c[found] = heap[pos].c;
+        diff[found] = heap[pos].diff;
+        found++;
+
+        /* its children become candidates, at most one more candidate than entries found */
+        if (2 * pos + 1 < heap_len) {
+            cand[ncand++] = 2 * pos + 1;
+        }
+        if (2 * pos + 2 < heap_len) {
+            cand[ncand++] = 2 * pos + 2;
+        }
+    }
+
+    if (pthread_mutex_unlock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to unlock differential heap mutex");
+    }
+
+    return found;
+}
+
+
+/**
+ * Returns the commodity whose deficit round-robin turn it is among those tied for the largest weighted backlog
+ * differential: the head of the tie list.  Only to be called from the releasing thread.
+ *
+ * A commodity that has joined the tie since its last turn loses the deficit round-robin credit it had left, being
+ * returned here with commodity::deficit zeroed.
+ *
+ * \param diff Filled with the (unweighted) backlog differential of the commodity returned.
+ *
+ * \return Commodity whose turn it is, or NULL unless at least two commodities are tied.
+ */
+commodity_t *diffheap_turn(uint32_t *diff) {
+
+    commodity_t *c = NULL;
+
+    if (pthread_mutex_lock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to lock differential heap mutex");
+    }
+
+    if (ties_len >= 2) {
+        c = TAILQ_FIRST(&ties);
+        if (c->tie_joined) {
+            c->deficit = 0;
+            c->tie_joined = 0;
+        }
+        *diff = heap[c->heap].diff;
+    }
+
+    if (pthread_mutex_unlock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to unlock differential heap mutex");
+    }
+
+    return c;
+}
+
+
+/**
+ * End a commodity's deficit round-robin turn, moving it to the end of the tie list if it is still tied.  Only to be
+ * called from the releasing thread.
+ *
+ * \param c Commodity whose turn ended.
+ */
+void diffheap_turn_end(commodity_t *c) {
+
+    if (pthread_mutex_lock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to lock differential heap mutex");
+    }
+
+    if (c->tied) {
+        TAILQ_REMOVE(&ties, c, tie);
+        TAILQ_INSERT_TAIL(&ties, c, tie);
+    }
+
+    if (pthread_mutex_unlock(&heap_mutex) != 0) {
+        BPRD_LOG_ERR("Unable to unlock differential heap mutex");
+    }
+}
+
+
+/**
+ * Free the heap.
+ */
+void diffheap_free() {
+
+    free(heap);
+    heap = NULL;
+    heap_len = 0;
+    TAILQ_INIT(&ties);
+    ties_len = 0;
+}
+
+/** \} */
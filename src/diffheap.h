@@ -0,0 +1,29 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __DIFFHEAP_H
+#define __DIFFHEAP_H
+
+#include <stdint.h>
+
+#include "commodity.h"
+#include "list.h"
+
+#define DIFFHEAP_TOP_MAX 64     /**< Largest number of commodities diffheap_top() returns. */
+
+extern int diffheap_init(list_t *clist, uint32_t tol);
+extern void diffheap_update(commodity_t *c, uint32_t diff);
+extern uint32_t diffheap_top(commodity_t **c, uint32_t *diff, uint32_t n);
+extern commodity_t *diffheap_turn(uint32_t *diff);
+extern void diffheap_turn_end(commodity_t *c);
+extern void diffheap_free();
+
+#endif /* __DIFFHEAP_H */
@@ -19,38 +19,898 @@
 #include <netinet/in.h>                 /* must come before linux/netfilter.h so in_addr and in6_addr are defined */
                        /* http://fixunix.com/debian/494850-bug-487103-linux-libc-dev-netfilter-h-needs-h-include.html */
 
+#include <arpa/inet.h>                              /* for ntohl() */
 #include <stdio.h>                                  /* for printf() */
+#include <stdlib.h>                                 /* for calloc(), free() */
+#include <string.h>                                 /* for memcpy() */
 #include <linux/netfilter.h>                        /* for NF_ACCEPT/NF_DROP */
-#include <libnetfilter_queue/libnetfilter_queue.h>  /* for nfq_set_verdict() */
+#include <linux/netlink.h>                          /* for struct nlmsghdr, struct nlattr */
+#include <libnetfilter_queue/libnetfilter_queue.h>  /* for nfq_set_verdict*() */
+
+#include "util.h"                                   /* for monotime_usec() */
+
+
+/* tail is written by a backlogger thread and the others by the releasing thread, all may be read by any thread */
+#define FIFO_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define FIFO_STORE(x,v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+#define FIFO_ECN_MASK 0x03  /**< ECN field of the IP header. */
+#define FIFO_ECN_ECT1 0x01  /**< ECN-capable transport (1). */
+#define FIFO_ECN_ECT0 0x02  /**< ECN-capable transport (0). */
+#define FIFO_ECN_CE 0x03    /**< Congestion experienced. */
+
+
+/**
+ * \struct bprd_fifo_pkt
+ * Metadata of a packet currently held in the kernel.
+ * \var bprd_fifo_pkt::id
+ * The ID assigned to the packet by the kernel.
+ * \var bprd_fifo_pkt::len
+ * Length of the packet (bytes).
+ * \var bprd_fifo_pkt::segs
+ * Number of segments the packet stands for, more than one only for GSO packets.
+ * \var bprd_fifo_pkt::tstamp
+ * Time the packet was enqueued (useconds, \see monotime_usec).
+ */
+
+
+/**
+ * \enum bprd_fifo_discipline
+ * Order in which queued packets are served.
+ * \var FIFO_DISC_FIFO
+ * Oldest packet first.
+ * \var FIFO_DISC_LIFO
+ * Newest packet first.
+ * \var FIFO_DISC_HYBRID
+ * Newest packet first, unless the oldest packet has waited longer than the queue's deadline.
+ */
+
+
+/**
+ * \struct bprd_simple_fifo
+ * Queue for keep tracking packets currently being held in the kernel.  The actual ID of each enqueued packet is
+ * stored in a preallocated ring whose size is a power of two.  The ring is written by a single backlogger thread and
+ * emptied by a single releasing thread into a deque of the same size, from which packets are served according to
+ * the queue's discipline.  Neither thread takes a lock.
+ * \var bprd_simple_fifo::ring
+ * Storage for packets handed over by the backlogger thread.
+ * \var bprd_simple_fifo::mask
+ * Size of \a ring and \a deq minus one.
+ * \var bprd_simple_fifo::head
+ * Free-running index of the oldest packet in \a ring, only advanced by the releasing thread.
+ * \var bprd_simple_fifo::tail
+ * Free-running index one past the newest packet in \a ring, only advanced by the backlogger thread.
+ * \var bprd_simple_fifo::deq
+ * Storage for packets owned by the releasing thread, oldest at \a dhead.
+ * \var bprd_simple_fifo::dhead
+ * Free-running index of the oldest packet in \a deq.
+ * \var bprd_simple_fifo::dtail
+ * Free-running index one past the newest packet in \a deq.
+ * \var bprd_simple_fifo::disc
+ * Service discipline.
+ * \var bprd_simple_fifo::deadline
+ * Age beyond which FIFO_DISC_HYBRID serves the oldest packet (useconds).
+ * \var bprd_simple_fifo::bytes_in
+ * Free-running count of bytes enqueued, only advanced by the backlogger thread.
+ * \var bprd_simple_fifo::bytes_out
+ * Free-running count of bytes released or dropped, only advanced by the releasing thread.
+ * \var bprd_simple_fifo::segs_in
+ * Free-running count of segments enqueued, only advanced by the backlogger thread.
+ * \var bprd_simple_fifo::segs_out
+ * Free-running count of segments released or dropped, only advanced by the releasing thread.
+ * \var bprd_simple_fifo::pkts_out
+ * Free-running count of packets released or dropped, only advanced by the releasing thread, so that \a tail minus it
+ * is the number of packets held however they are split between \a ring and \a deq.
+ * \var bprd_simple_fifo::mtu
+ * Largest packet that is a single segment (bytes), zero if packets are never GSO packets.
+ * \var bprd_simple_fifo::hdr
+ * Length of the headers repeated in each segment of a GSO packet (bytes).
+ * \var bprd_simple_fifo::limit
+ * Maximum number of packets held before new packets are dropped on arrival.
+ * \var bprd_simple_fifo::target
+ * Sojourn time the AQM tolerates before dropping (useconds), zero disables the AQM.
+ * \var bprd_simple_fifo::interval
+ * Time the sojourn time must stay above \a target before the AQM starts dropping (useconds).
+ * \var bprd_simple_fifo::first_above
+ * Time at which the AQM will start dropping if the sojourn time stays above \a target, zero if below.
+ * \var bprd_simple_fifo::drop_next
+ * Time of the next AQM drop while dropping.
+ * \var bprd_simple_fifo::drop_count
+ * Number of AQM drops since entering the dropping state, plus the count it was resumed from.
+ * \var bprd_simple_fifo::drop_last
+ * \a drop_count on last entering the dropping state.
+ * \var bprd_simple_fifo::dropping
+ * Boolean integer indicating if the AQM is in the dropping state.
+ * \var bprd_simple_fifo::aqm_drops
+ * Number of packets dropped by the AQM.
+ * \var bprd_simple_fifo::shared
+ * Boolean integer indicating if the netfilter queue also holds packets of other queues, which rules out batched
+ * verdicts.
+ * \var bprd_simple_fifo::last_id
+ * The ID of the most recently enqueued packet.
+ * \var bprd_simple_fifo::overruns
+ * Number of packet IDs skipped because the kernel dropped the packet or its enqueue notification.
+ * \var bprd_simple_fifo::overflows
+ * Number of packets dropped because the queue was full.
+ * \var bprd_simple_fifo::shadow_pct
+ * Percentage by which arrivals to the shadow queue exceed real arrivals, zero disables the shadow queue.
+ * \var bprd_simple_fifo::shadow_bytes
+ * Boolean integer indicating if the shadow queue is measured in bytes rather than segments.
+ * \var bprd_simple_fifo::shadow_in
+ * Free-running count of arrivals to the shadow queue (hundredths of a segment or byte), only advanced by the
+ * backlogger thread.
+ * \var bprd_simple_fifo::shadow_out
+ * Free-running count of departures from the shadow queue (hundredths of a segment or byte), only advanced by the
+ * releasing thread and never past \a shadow_in.
+ * \var bprd_simple_fifo::qh
+ * The netfilter queue handle.
+ */
+
+
+/**
+ * Round up to the next power of two.
+ *
+ * \param n Number to round up.
+ *
+ * \return Smallest power of two not less than \a n.
+ */
+static uint32_t fifo_roundup(uint32_t n)
+{
+	uint32_t size = 1;
+	while (size < n)
+	{
+		size <<= 1;
+	}
+	return size;
+}
+
+
+/**
+ * Integer square root.
+ *
+ * \param n Number.
+ *
+ * \return Largest integer whose square is not greater than \a n.
+ */
+static uint32_t fifo_isqrt(uint32_t n)
+{
+	uint64_t x = n, y = (x + 1) / 2;
+	while (y < x)
+	{
+		x = y;
+		y = (x + n / x) / 2;
+	}
+	return (uint32_t)x;
+}
+
+
+/**
+ * Length of a packet as queued by the kernel, read from the NFQA_CAP_LEN attribute of its netlink message.
+ *
+ * libnetfilter_queue offers no accessor for the attribute, but hands callbacks the nfgenmsg right after the netlink
+ * message header, so the message's attributes are walked from there.  The kernel only sends the attribute when the
+ * packet was copied in part.
+ *
+ * \param nfmsg Netfilter message of the packet, as passed to a libnetfilter_queue callback.
+ *
+ * \return Length of the packet (bytes), zero if the whole packet was copied.
+ */
+static uint32_t fifo_cap_len(nfgenmsg_t *nfmsg)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)((char *)nfmsg - NLMSG_HDRLEN);
+	struct nlattr *nla = (struct nlattr *)((char *)nfmsg + NLMSG_ALIGN(sizeof(*nfmsg)));
+	int rem = (int)nlh->nlmsg_len - NLMSG_HDRLEN - NLMSG_ALIGN(sizeof(*nfmsg));
+	uint32_t len;
+
+	while (rem >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla) && nla->nla_len <= rem)
+	{
+		if ((nla->nla_type & NLA_TYPE_MASK) == NFQA_CAP_LEN && nla->nla_len >= NLA_HDRLEN + sizeof(len))
+		{
+			memcpy(&len, (char *)nla + NLA_HDRLEN, sizeof(len));
+			return ntohl(len);
+		}
+		rem -= NLA_ALIGN(nla->nla_len);
+		nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+
+	return 0;
+}
+
+
+/**
+ * Length of a packet.
+ *
+ * The kernel's own length is used when the packet was copied in part.  Otherwise it is read from the IP header at
+ * the start of the copied payload, whose IPv4 total length is zero in GSO packets beyond 64KB, and those are copied
+ * whole when no NFQA_CAP_LEN is sent.
+ *
+ * \param nfmsg Netfilter message of the packet.
+ * \param nfa Netfilter queue packet data.
+ *
+ * \return Length of the packet (bytes).
+ */
+static uint32_t fifo_payload_len(nfgenmsg_t *nfmsg, nfq_data_t *nfa)
+{
+	unsigned char *payload;
+	uint32_t cap = fifo_cap_len(nfmsg);
+	int n = nfq_get_payload(nfa, &payload);
+
+	if (cap > 0)
+	{
+		return cap;
+	}
+	else if (n >= 4 && (payload[0] >> 4) == 4 && (payload[2] | payload[3]))
+	{
+		/* IPv4 total length */
+		return ((uint32_t)payload[2] << 8) | payload[3];
+	}
+	else if (n >= 6 && (payload[0] >> 4) == 6 && (payload[4] | payload[5]))
+	{
+		/* IPv6 payload length plus fixed header, zero in jumbograms */
+		return 40 + (((uint32_t)payload[4] << 8) | payload[5]);
+	}
+
+	return n > 0 ? (uint32_t)n : 0;
+}
+
+
+/**
+ * Hash the flow of a packet from the headers at the start of its copied payload.
+ *
+ * \param nfa Netfilter queue packet data.
+ *
+ * \return Hash of the packet's 5-tuple.
+ */
+static uint32_t fifo_payload_flow(nfq_data_t *nfa)
+{
+	unsigned char *payload;
+	int n = nfq_get_payload(nfa, &payload);
+
+	return flowlet_hash(payload, n);
+}
+
+
+/**
+ * Copy a packet that may be marked with ECN CE on release.
+ *
+ * Only ECN-capable packets copied whole are kept, since the payload handed back with a verdict replaces the packet.
+ *
+ * \param nfa Netfilter queue packet data.
+ *
+ * \return A copy of the packet, to be freed by the caller.
+ * \retval NULL If the packet is not ECN-capable, was not copied whole, or on error.
+ */
+static unsigned char *fifo_payload_ect(nfq_data_t *nfa)
+{
+	unsigned char *payload, *data;
+	int n = nfq_get_payload(nfa, &payload);
+	uint32_t len, ecn;
+
+	if (n >= 20 && (payload[0] >> 4) == 4)
+	{
+		len = ((uint32_t)payload[2] << 8) | payload[3];
+		ecn = payload[1] & FIFO_ECN_MASK;
+	}
+	else if (n >= 40 && (payload[0] >> 4) == 6)
+	{
+		len = 40 + (((uint32_t)payload[4] << 8) | payload[5]);
+		ecn = (payload[1] >> 4) & FIFO_ECN_MASK;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	if ((ecn != FIFO_ECN_ECT0 && ecn != FIFO_ECN_ECT1) || len != (uint32_t)n ||
+	    (data = (unsigned char *)malloc(len)) == NULL)
+	{
+		return NULL;
+	}
+
+	return memcpy(data, payload, len);
+}
+
+
+/**
+ * Set the ECN field of a packet to CE, fixing up the IPv4 header checksum incrementally (RFC 1624).
+ *
+ * \param data The packet, starting with its IP header.
+ */
+static void fifo_mark_ce(unsigned char *data)
+{
+	uint32_t sum;
+	uint16_t old;
+
+	if ((data[0] >> 4) == 6)
+	{
+		data[1] |= FIFO_ECN_CE << 4;
+		return;
+	}
+
+	old = (uint16_t)((data[0] << 8) | data[1]);
+	data[1] |= FIFO_ECN_CE;
+
+	/* HC' = ~(~HC + ~m + m') */
+	sum = (uint16_t)~((data[10] << 8) | data[11]);
+	sum += (uint16_t)~old;
+	sum += (uint16_t)((data[0] << 8) | data[1]);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	data[10] = (unsigned char)(~sum >> 8);
+	data[11] = (unsigned char)~sum;
+}
+
+
+/**
+ * Estimate the number of segments a packet stands for.
+ *
+ * \param queue The queue.
+ * \param len Length of the packet (bytes).
+ *
+ * \return Number of segments of at most the queue's MTU the packet would be cut into.
+ */
+static uint32_t fifo_payload_segs(fifo_t *queue, uint32_t len)
+{
+	if (!(queue)->mtu || len <= (queue)->mtu)
+	{
+		return 1;
+	}
+
+	return (len - (queue)->hdr + ((queue)->mtu - (queue)->hdr) - 1) / ((queue)->mtu - (queue)->hdr);
+}
+
+
+/**
+ * Move every packet handed over by the backlogger thread into the deque.
+ *
+ * The deque's tail is published before the ring's head so that other threads never see fewer packets than are
+ * actually held.
+ *
+ * \param queue The queue to drain.
+ */
+static void fifo_drain(fifo_t *queue)
+{
+	uint32_t head = (queue)->head;
+	uint32_t tail = FIFO_LOAD((queue)->tail);
+	uint32_t dtail = (queue)->dtail;
+
+	if (head == tail)
+	{
+		return;
+	}
+
+	while (head != tail)
+	{
+		(queue)->deq[dtail++ & (queue)->mask] = (queue)->ring[head++ & (queue)->mask];
+	}
+	FIFO_STORE((queue)->dtail, dtail);
+	FIFO_STORE((queue)->head, head);
+}
+
+
+/**
+ * Find the next packet to be served according to the queue's discipline.
+ *
+ * \param queue The queue.
+ * \param front Set to a Boolean integer indicating if the packet is at the front (oldest end) of the deque.
+ *
+ * \returns The next packet, left in the queue.
+ * \retval NULL If the queue is empty.
+ */
+static fifo_pkt_t *fifo_next(fifo_t *queue, int *front)
+{
+	fifo_drain(queue);
+	if ((queue)->dhead == (queue)->dtail)
+	{
+		return NULL;
+	}
+
+	*front = !((queue)->disc == FIFO_DISC_LIFO ||
+	           ((queue)->disc == FIFO_DISC_HYBRID &&
+	            monotime_usec() - (queue)->deq[(queue)->dhead & (queue)->mask].tstamp <= (queue)->deadline));
+
+	/* oldest or newest packet */
+	return *front ? &(queue)->deq[(queue)->dhead & (queue)->mask] : &(queue)->deq[((queue)->dtail - 1) & (queue)->mask];
+}
+
+
+/**
+ * Remove a packet found by fifo_next() from the queue.
+ *
+ * \param queue The queue.
+ * \param pkt The packet, which stays valid until the next call on \a queue.
+ * \param front Boolean integer indicating if the packet is at the front of the deque, as set by fifo_next().
+ */
+static void fifo_remove(fifo_t *queue, fifo_pkt_t *pkt, int front)
+{
+	if (front)
+	{
+		FIFO_STORE((queue)->dhead, (queue)->dhead + 1);
+	}
+	else
+	{
+		FIFO_STORE((queue)->dtail, (queue)->dtail - 1);
+	}
+	FIFO_STORE((queue)->bytes_out, (queue)->bytes_out + pkt->len);
+	FIFO_STORE((queue)->segs_out, (queue)->segs_out + pkt->segs);
+	FIFO_STORE((queue)->pkts_out, (queue)->pkts_out + 1);
+}
+
+
+/**
+ * Remove the next packet to be served according to the queue's discipline.
+ *
+ * \param queue The queue.
+ *
+ * \returns The removed packet, valid until the next call on \a queue.
+ * \retval NULL If the queue is empty.
+ */
+static fifo_pkt_t *fifo_pop(fifo_t *queue)
+{
+	fifo_pkt_t *pkt;
+	int front;
+
+	if ((pkt = fifo_next(queue, &front)) == NULL)
+	{
+		return NULL;
+	}
+
+	fifo_remove(queue, pkt, front);
+	return pkt;
+}
+
+
+/**
+ * Accept a packet of the queue, setting its mark if the queue marks released packets.
+ *
+ * A packet of an active flowlet keeps the mark of its flowlet rather than taking the queue's current mark.  A copied
+ * ECN-capable packet is marked CE and handed back with the verdict if the queue is congested, and freed either way.
+ *
+ * \param queue The queue.
+ * \param pkt The packet.
+ * \param batch Boolean integer indicating if every packet of the netfilter queue up to \a pkt is accepted.
+ */
+static void fifo_accept(fifo_t *queue, fifo_pkt_t *pkt, int batch)
+{
+	uint32_t mark = (queue)->mark;
+	uint32_t len = 0;
+	uint64_t now = 0;
+
+	if (!batch && ((queue)->flowlets || pkt->data))
+	{
+		now = monotime_usec();
+	}
+
+	if ((queue)->marking && !batch && (queue)->flowlets)
+	{
+		mark = flowlet_mark((queue)->flowlets, pkt->flow, mark, now);
+	}
+
+	if (pkt->data &&
+	    (((queue)->ecn_backlog && fifo_segments(queue) >= (queue)->ecn_backlog) ||
+	     ((queue)->ecn_sojourn && now - pkt->tstamp >= (queue)->ecn_sojourn)))
+	{
+		/* tell the sender about the queue before it overflows */
+		fifo_mark_ce(pkt->data);
+		len = pkt->len;
+		FIFO_STORE((queue)->ecn_marks, (queue)->ecn_marks + 1);
+	}
+
+	if ((queue)->marking && batch)
+	{
+		nfq_set_verdict_batch2((queue)->qh, pkt->id, NF_ACCEPT, mark);
+	}
+	else if ((queue)->marking)
+	{
+		nfq_set_verdict2((queue)->qh, pkt->id, NF_ACCEPT, mark, len, pkt->data);
+	}
+	else if (batch)
+	{
+		nfq_set_verdict_batch((queue)->qh, pkt->id, NF_ACCEPT);
+	}
+	else
+	{
+		nfq_set_verdict((queue)->qh, pkt->id, NF_ACCEPT, len, pkt->data);
+	}
+
+	free(pkt->data);
+	pkt->data = NULL;
+}
+
+
+/**
+ * Remove and send a packet found by fifo_next(), so that the packet sent is the one that was looked at even if the
+ * discipline would now pick another.
+ *
+ * \param queue The queue.
+ * \param pkt The packet.
+ * \param front Boolean integer indicating if the packet is at the front of the deque, as set by fifo_next().
+ */
+static void fifo_send_pkt(fifo_t *queue, fifo_pkt_t *pkt, int front)
+{
+	fifo_remove(queue, pkt, front);
+	fifo_accept(queue, pkt, 0);
+}
+
+
+/**
+ * Initialize the internal representation FIFO queue.
+ * 
+ * \param queue The queue.
+ * \param size Number of packets the queue can hold, rounded up to a power of two.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+int fifo_init(fifo_t *queue, uint32_t size)
+{
+	if (queue)
+	{
+		size = fifo_roundup(size ? size : 1);
+		if (((queue)->ring = (fifo_pkt_t *)calloc(size, sizeof(fifo_pkt_t))) == NULL ||
+		    ((queue)->deq = (fifo_pkt_t *)calloc(size, sizeof(fifo_pkt_t))) == NULL)
+		{
+			free((queue)->ring);
+			return -1;
+		}
+		(queue)->mask = size - 1;
+		(queue)->head = 0;
+		(queue)->tail = 0;
+		(queue)->dhead = 0;
+		(queue)->dtail = 0;
+		(queue)->disc = FIFO_DISC_FIFO;
+		(queue)->deadline = 0;
+		(queue)->bytes_in = 0;
+		(queue)->bytes_out = 0;
+		(queue)->segs_in = 0;
+		(queue)->segs_out = 0;
+		(queue)->pkts_out = 0;
+		(queue)->mtu = 0;
+		(queue)->hdr = 0;
+		(queue)->limit = size;
+		(queue)->target = 0;
+		(queue)->interval = 0;
+		(queue)->first_above = 0;
+		(queue)->drop_next = 0;
+		(queue)->drop_count = 0;
+		(queue)->drop_last = 0;
+		(queue)->dropping = 0;
+		(queue)->aqm_drops = 0;
+		(queue)->shared = 0;
+		(queue)->last_id = 0;
+		(queue)->overruns = 0;
+		(queue)->overflows = 0;
+		(queue)->lost = 0;
+		(queue)->fail_open = 0;
+		(queue)->marking = 0;
+		(queue)->mark = 0;
+		(queue)->flowlets = NULL;
+		(queue)->ecn_backlog = 0;
+		(queue)->ecn_sojourn = 0;
+		(queue)->ecn_marks = 0;
+		(queue)->admit_v = 0;
+		(queue)->admit_bytes = 0;
+		(queue)->rejected = 0;
+		(queue)->shadow_pct = 0;
+		(queue)->shadow_bytes = 0;
+		(queue)->shadow_in = 0;
+		(queue)->shadow_out = 0;
+		(queue)->qh = NULL;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Set the order in which a queue serves its packets.
+ *
+ * \param queue The queue.
+ * \param disc The service discipline.
+ * \param deadline Age beyond which FIFO_DISC_HYBRID serves the oldest packet (useconds).
+ */
+void fifo_set_discipline(fifo_t *queue, fifo_disc_t disc, uint64_t deadline)
+{
+	if (queue)
+	{
+		(queue)->disc = disc;
+		(queue)->deadline = deadline;
+	}
+}
+
+
+/**
+ * Configure active queue management of a queue.
+ *
+ * \param queue The queue.
+ * \param target Sojourn time tolerated before dropping (useconds), zero disables dropping by sojourn time.
+ * \param interval Time the sojourn time must stay above \a target before dropping starts (useconds).
+ * \param limit Maximum number of packets held, zero or more than the queue can track means the queue's size.
+ */
+void fifo_set_aqm(fifo_t *queue, uint64_t target, uint64_t interval, uint32_t limit)
+{
+	if (queue)
+	{
+		(queue)->target = target;
+		(queue)->interval = interval;
+		(queue)->limit = (limit && limit <= (queue)->mask) ? limit : (queue)->mask + 1;
+	}
+}
+
+
+/**
+ * Check if the AQM may drop the oldest packet of a queue, which it may once its sojourn time has stayed above target
+ * for a whole interval.
+ *
+ * \param queue The queue.
+ * \param now Current time (useconds).
+ *
+ * \returns Boolean integer indicating if the oldest packet may be dropped.
+ */
+static int fifo_aqm_ok(fifo_t *queue, uint64_t now)
+{
+	fifo_drain(queue);
+	if ((queue)->dhead == (queue)->dtail ||
+	    now - (queue)->deq[(queue)->dhead & (queue)->mask].tstamp <= (queue)->target)
+	{
+		(queue)->first_above = 0;
+		return 0;
+	}
+	if ((queue)->first_above == 0)
+	{
+		(queue)->first_above = now + (queue)->interval;
+		return 0;
+	}
+
+	return now >= (queue)->first_above;
+}
+
+
+/**
+ * Drop packets whose sojourn time has stayed above target for too long.
+ *
+ * Follows CoDel (RFC 8289): once the oldest packet has waited longer than the queue's target for a whole interval,
+ * the oldest packet is dropped and the queue enters the dropping state.  While dropping, the next drop is scheduled
+ * interval/sqrt(drops) later, so the drop rate grows until the sojourn time falls back below target, and every drop
+ * that has come due since the last call is made.  A queue re-entering the dropping state within 16 intervals of its
+ * last scheduled drop resumes from the drops it made last time rather than from one.  Unlike CoDel, this is run
+ * periodically by the releasing thread rather than only when a packet is released, so a queue whose next hop has
+ * stalled is still kept in check.
+ *
+ * \param queue The queue.
+ *
+ * \return Number of packets dropped.
+ */
+uint32_t fifo_aqm(fifo_t *queue)
+{
+	uint32_t n = 0, delta;
+	uint64_t now;
+
+	if (!queue || !(queue)->target)
+	{
+		return 0;
+	}
+
+	now = monotime_usec();
+	if ((queue)->dropping)
+	{
+		(queue)->dropping = fifo_aqm_ok(queue, now);
+		while ((queue)->dropping && now >= (queue)->drop_next)
+		{
+			fifo_drop_packet(queue);
+			n++;
+			(queue)->drop_count++;
+			if (((queue)->dropping = fifo_aqm_ok(queue, now)))
+			{
+				(queue)->drop_next += (queue)->interval / fifo_isqrt((queue)->drop_count);
+			}
+		}
+	}
+	else if (fifo_aqm_ok(queue, now))
+	{
+		/* sojourn time has been above target for an interval, start dropping */
+		fifo_drop_packet(queue);
+		n++;
+		(queue)->dropping = 1;
+		delta = (queue)->drop_count - (queue)->drop_last;
+		(queue)->drop_count = (delta > 1 && now < (queue)->drop_next + 16 * (queue)->interval) ? delta : 1;
+		(queue)->drop_next = now + (queue)->interval / fifo_isqrt((queue)->drop_count);
+		(queue)->drop_last = (queue)->drop_count;
+	}
+
+	FIFO_STORE((queue)->aqm_drops, (queue)->aqm_drops + n);
+	return n;
+}
+
+
+/**
+ * Mark a queue as sharing its netfilter queue with other queues.
+ *
+ * Packets are then released with one verdict each, since a batched verdict would also release packets of the other
+ * queues.  The netfilter queue handle is set by the first call to fifo_enqueue().
+ *
+ * \param queue The queue.
+ */
+void fifo_set_shared(fifo_t *queue)
+{
+	if (queue)
+	{
+		(queue)->shared = 1;
+	}
+}
+
+
+/**
+ * Count GSO packets handed over by the kernel as the number of segments they will be cut into.
+ *
+ * \param queue The queue.
+ * \param mtu Largest packet that is a single segment (bytes), zero to count every packet as one segment.
+ * \param hdr Length of the headers repeated in each segment (bytes), less than \a mtu.
+ */
+void fifo_set_gso(fifo_t *queue, uint32_t mtu, uint32_t hdr)
+{
+	if (queue)
+	{
+		(queue)->mtu = mtu;
+		(queue)->hdr = hdr < mtu ? hdr : 0;
+	}
+}
+
+
+/**
+ * Accept rather than drop packets arriving at a full queue, so that they are routed normally.
+ *
+ * \param queue The queue.
+ */
+void fifo_set_fail_open(fifo_t *queue)
+{
+	if (queue)
+	{
+		(queue)->fail_open = 1;
+	}
+}
+
+
+/**
+ * Set the mark of packets released from now on, so that policy routing can pick their next hop.
+ *
+ * Only to be called from the releasing thread.
+ *
+ * \param queue The queue.
+ * \param mark The firewall mark.
+ */
+void fifo_set_mark(fifo_t *queue, uint32_t mark)
+{
+	if (queue)
+	{
+		(queue)->marking = 1;
+		(queue)->mark = mark;
+	}
+}
+
+
+/**
+ * Keep the packets of each flowlet on one next hop when marking released packets.
+ *
+ * The flow of each packet is hashed as it is enqueued, and packets are then released with one verdict each, since
+ * packets of one batch may belong to flowlets on different next hops.
+ *
+ * \param queue The queue.
+ * \param ft The flowlet table, only used by the releasing thread.
+ */
+void fifo_set_flowlets(fifo_t *queue, flowlet_table_t *ft)
+{
+	if (queue)
+	{
+		(queue)->flowlets = ft;
+	}
+}
+
+
+/**
+ * Mark ECN-capable packets CE as they are released from a congested queue.
+ *
+ * Packets are then copied whole as they are enqueued, which takes a netfilter queue copying whole packets, and
+ * released with one verdict each, since a batched verdict cannot carry payloads.
+ *
+ * \param queue The queue.
+ * \param backlog Number of segments left queued at or above which packets are marked, zero to ignore the backlog.
+ * \param sojourn Time queued at or above which packets are marked (useconds), zero to ignore the sojourn time.
+ */
+void fifo_set_ecn(fifo_t *queue, uint32_t backlog, uint64_t sojourn)
+{
+	if (queue)
+	{
+		(queue)->ecn_backlog = backlog;
+		(queue)->ecn_sojourn = sojourn;
+	}
+}
 
 
 /**
- * \struct bprd_simple_fifo
- * Simple FIFO queue for keep tracking packets currently being
- * held in the kernel. Each enqueued packet is given an id number
- * that is sequentially increasing.
- * \var bprd_simple_fifo::head
- * The ID of the most recently released packet.
- * \var bprd_simple_fifo::tail
- * The ID of the most recently enqueued packet.
- * \var bprd_simple_fifo::qh
- * The netfilter queue handle.
+ * Control the admission of locally originated packets by drift-plus-penalty.
+ *
+ * Admitting a packet rewards the local application with utility V but adds the packet to a backlog Q, which grows the
+ * Lyapunov drift by Q.  Minimizing drift minus V times utility, a packet is admitted only while Q is below V.  The
+ * backlog then stays below V plus one packet, while throughput comes within O(1/V) of the best the network can carry.
+ * Forwarded packets are always admitted.
+ *
+ * \param queue The queue.
+ * \param v Utility weight V, zero admits every packet.
+ * \param bytes Boolean integer indicating if \a v and the backlog are measured in bytes rather than segments.
  */
+void fifo_set_admission(fifo_t *queue, uint32_t v, int bytes)
+{
+	if (queue)
+	{
+		(queue)->admit_v = v;
+		(queue)->admit_bytes = bytes;
+	}
+}
 
 
 /**
- * Initialize the internal representation FIFO queue.
- * 
+ * Keep a shadow queue alongside the real queue.
+ *
+ * Every packet enqueued adds its segments or bytes to the shadow queue, plus \a pct percent.  Backpressure decisions
+ * are then made on the shadow queue, which is served what those decisions grant whether or not the real queue holds
+ * that many packets (\see fifo_shadow_serve).  Because the shadow queue's arrival rate slightly exceeds the real one,
+ * it builds the gradients backpressure needs while the real queue is drained as soon as packets can go anywhere.
+ *
  * \param queue The queue.
+ * \param pct Percentage by which shadow arrivals exceed real arrivals, zero disables the shadow queue.
+ * \param bytes Boolean integer indicating if the shadow queue is measured in bytes rather than segments.
  */
-void fifo_init(fifo_t *queue)
+void fifo_set_shadow(fifo_t *queue, uint32_t pct, int bytes)
 {
 	if (queue)
 	{
-		(queue)->head = 0;
-		(queue)->tail = 0;
-		(queue)->qh = NULL;
+		(queue)->shadow_pct = pct;
+		(queue)->shadow_bytes = bytes;
+	}
+}
+
+
+/**
+ * Returns the length of the shadow queue.
+ *
+ * Safe to call from any thread without holding a lock.
+ *
+ * \param queue The queue whose shadow queue length will be reported.
+ *
+ * \return Length of the shadow queue, in segments or bytes.
+ */
+uint32_t fifo_shadow(fifo_t *queue)
+{
+	uint64_t out, len;
+	if (!queue)
+	{
+		return 0;
+	}
+	out = FIFO_LOAD((queue)->shadow_out);
+
+	len = (FIFO_LOAD((queue)->shadow_in) - out) / 100;
+	return (len > UINT32_MAX) ? UINT32_MAX : (uint32_t)len;
+}
+
+
+/**
+ * Serve the shadow queue, never below empty.  Only to be called from the releasing thread.
+ *
+ * \param queue The queue.
+ * \param amount Segments or bytes the shadow queue was granted.
+ */
+void fifo_shadow_serve(fifo_t *queue, uint32_t amount)
+{
+	uint64_t len, served;
+	if (!queue || !(queue)->shadow_pct)
+	{
+		return;
 	}
+
+	len = FIFO_LOAD((queue)->shadow_in) - (queue)->shadow_out;
+	served = (uint64_t)amount * 100;
+	FIFO_STORE((queue)->shadow_out, (queue)->shadow_out + ((served < len) ? served : len));
 }
 
 
@@ -59,21 +919,35 @@ void fifo_init(fifo_t *queue)
  * 
  * Function prototype specified by libnetfilter_queue
  *
+ * IDs skipped over belong to packets the kernel dropped before they reached userspace and are counted as overruns.
+ *
+ * \see fifo_enqueue
+ *
  * \param qh
  * \param nfmsg
  * \param nfa
  * \param data
  */
-int fifo_add_packet(nfq_qh_t *qh __attribute__ ((unused)), 
-                    nfgenmsg_t *nfmsg __attribute__ ((unused)), 
-                    nfq_data_t *nfa __attribute__ ((unused)), 
+int fifo_add_packet(nfq_qh_t *qh, 
+                    nfgenmsg_t *nfmsg, 
+                    nfq_data_t *nfa, 
                     void *data)
 {
 	fifo_t *queue = (fifo_t *) data;
-	if (queue)
+	struct nfqnl_msg_packet_hdr *ph;
+	uint32_t id;
+
+	if ((queue) && ((ph = nfq_get_msg_packet_hdr(nfa)) != NULL))
 	{
-        printf("Adding one to end of queue!");
-		(queue)->tail += 1;
+		id = ntohl(ph->packet_id);
+
+		if (id > (queue)->last_id + 1)
+		{
+			FIFO_STORE((queue)->overruns, (queue)->overruns + (id - (queue)->last_id - 1));
+		}
+		(queue)->last_id = id;
+
+		fifo_enqueue(queue, qh, nfmsg, nfa, id);
 	}
 
 	// Callback should return < 0 to stop processing
@@ -82,19 +956,170 @@ int fifo_add_packet(nfq_qh_t *qh __attribute__ ((unused)),
 
 
 /**
- * Send head of queue.
+ * Add a packet to the queue.
+ *
+ * The ID the kernel assigned to the packet, its length and the time it was enqueued are appended to the ring.  A
+ * locally originated packet not admitted (\see fifo_set_admission) is dropped.  If the queue holds its limit of
+ * packets the packet is dropped, or accepted if the queue fails open.  Only to be called from
+ * the queue's backlogger thread.
+ *
+ * \param queue The queue.
+ * \param qh The netfilter queue handle the packet arrived on.
+ * \param nfmsg Netfilter message of the packet.
+ * \param nfa The packet.
+ * \param id The ID the kernel assigned to the packet.
+ */
+void fifo_enqueue(fifo_t *queue, nfq_qh_t *qh, nfgenmsg_t *nfmsg, nfq_data_t *nfa, uint32_t id)
+{
+	fifo_pkt_t *pkt;
+
+	if ((queue)->admit_v && nfq_get_indev(nfa) == 0 &&
+	    ((queue)->admit_bytes ? fifo_bytes(queue) : fifo_segments(queue)) >= (queue)->admit_v)
+	{
+		/* admitting the packet would grow the backlog by more than its utility is worth */
+		FIFO_STORE((queue)->rejected, (queue)->rejected + 1);
+		nfq_set_verdict(qh, id, NF_DROP, 0, NULL);
+		return;
+	}
+
+	if (fifo_length(queue) >= (queue)->limit)
+	{
+		/* no room left for this packet */
+		FIFO_STORE((queue)->overflows, (queue)->overflows + 1);
+		nfq_set_verdict(qh, id, (queue)->fail_open ? NF_ACCEPT : NF_DROP, 0, NULL);
+		return;
+	}
+
+	if ((queue)->qh == NULL)
+	{
+		/* published to the releasing thread along with the packet */
+		(queue)->qh = qh;
+	}
+
+	pkt = &(queue)->ring[(queue)->tail & (queue)->mask];
+	pkt->id = id;
+	pkt->len = fifo_payload_len(nfmsg, nfa);
+	pkt->segs = fifo_payload_segs(queue, pkt->len);
+	pkt->flow = (queue)->flowlets ? fifo_payload_flow(nfa) : 0;
+	pkt->data = ((queue)->ecn_backlog || (queue)->ecn_sojourn) ? fifo_payload_ect(nfa) : NULL;
+	pkt->tstamp = monotime_usec();
+	FIFO_STORE((queue)->bytes_in, (queue)->bytes_in + pkt->len);
+	FIFO_STORE((queue)->segs_in, (queue)->segs_in + pkt->segs);
+	if ((queue)->shadow_pct)
+	{
+		FIFO_STORE((queue)->shadow_in, (queue)->shadow_in +
+		           (uint64_t)((queue)->shadow_bytes ? pkt->len : pkt->segs) * (100 + (queue)->shadow_pct));
+	}
+	FIFO_STORE((queue)->tail, (queue)->tail + 1);
+}
+
+
+/**
+ * Send the next packet of the queue.
  *
- * The head of queue is the oldest packet in the queue.  Uses nfq_set_verdict() with a verdic of NF_ACCEPT.
+ * The next packet is chosen by the queue's discipline.  Uses nfq_set_verdict() with a verdic of NF_ACCEPT, or
+ * nfq_set_verdict2() if the queue marks released packets.
  * 
  * \param queue The queue from which to send a packet.
  */
 void fifo_send_packet(fifo_t *queue)
 {
-	if ((queue) && ((queue)->head < (queue)->tail))
+	fifo_pkt_t *pkt;
+	if ((queue) && ((pkt = fifo_pop(queue)) != NULL))
+	{
+		fifo_accept(queue, pkt, 0);
+	}
+}
+
+
+/**
+ * Send up to \a count segments from the queue.
+ *
+ * \see fifo_send_bytes
+ *
+ * \param queue The queue from which to send packets.
+ * \param count Maximum number of segments to send.
+ *
+ * \return Number of packets sent.
+ */
+uint32_t fifo_send_packets(fifo_t *queue, uint32_t count)
+{
+	return fifo_send_bytes(queue, count, UINT32_MAX);
+}
+
+
+/**
+ * Send packets from the queue totalling no more than \a count segments and \a bytes bytes.
+ *
+ * Packets are taken in the order given by the queue's discipline, stopping at the first packet that does not fit in
+ * what remains of \a count or \a bytes.  The first packet is sent even if it does not fit, so that no packet is ever
+ * too large to leave the queue.  A packet is a single segment unless it is a GSO packet.  Under FIFO_DISC_FIFO,
+ * verdicts on the oldest packets are issued with a single nfq_set_verdict_batch() message, which accepts every packet
+ * in the netfilter queue with an ID less than or equal to the last one released.  Other disciplines do not release a
+ * prefix of the queue, a shared netfilter queue holds packets of other queues, packets of flowlets may take different
+ * marks, and packets marked CE carry their payload, so these issue one verdict per packet.
+ *
+ * \param queue The queue from which to send packets.
+ * \param count Maximum number of segments to send.
+ * \param bytes Maximum number of bytes to send.
+ *
+ * \return Number of packets sent.
+ */
+uint32_t fifo_send_bytes(fifo_t *queue, uint32_t count, uint32_t bytes)
+{
+	fifo_pkt_t *pkt;
+	uint32_t n, i, len, segs;
+	int front;
+
+	if (!queue)
+	{
+		return 0;
+	}
+
+	if ((queue)->disc != FIFO_DISC_FIFO || (queue)->shared || (queue)->flowlets || (queue)->ecn_backlog ||
+	    (queue)->ecn_sojourn)
+	{
+		for (n = 0, segs = 0, len = 0; segs < count && len < bytes && (pkt = fifo_next(queue, &front)) != NULL; n++)
+		{
+			if (n > 0 && (pkt->segs > count - segs || pkt->len > bytes - len))
+			{
+				break;
+			}
+			segs += pkt->segs;
+			len += pkt->len;
+			fifo_send_pkt(queue, pkt, front);
+		}
+		return n;
+	}
+
+	/* find the longest prefix that fits */
+	fifo_drain(queue);
+	for (n = 0, segs = 0, len = 0, i = (queue)->dhead; segs < count && len < bytes && i != (queue)->dtail; n++, i++)
+	{
+		pkt = &(queue)->deq[i & (queue)->mask];
+		if (n > 0 && (pkt->segs > count - segs || pkt->len > bytes - len))
+		{
+			break;
+		}
+		segs += pkt->segs;
+		len += pkt->len;
+	}
+
+	if (n == 1)
+	{
+		fifo_send_packet(queue);
+	}
+	else if (n > 1)
 	{
-		(queue)->head += 1;
-		nfq_set_verdict((queue)->qh, (queue)->head, NF_ACCEPT, 0, NULL);
+		pkt = &(queue)->deq[((queue)->dhead + n - 1) & (queue)->mask];
+		FIFO_STORE((queue)->dhead, (queue)->dhead + n);
+		FIFO_STORE((queue)->bytes_out, (queue)->bytes_out + len);
+		FIFO_STORE((queue)->segs_out, (queue)->segs_out + segs);
+		FIFO_STORE((queue)->pkts_out, (queue)->pkts_out + n);
+		fifo_accept(queue, pkt, 1);
 	}
+
+	return n;
 }
 
 
@@ -107,61 +1132,324 @@ void fifo_send_packet(fifo_t *queue)
  */
 void fifo_drop_packet(fifo_t *queue)
 {
-	if ((queue) && ((queue)->head < (queue)->tail))
+	fifo_pkt_t *pkt;
+	if (queue)
+	{
+		fifo_drain(queue);
+		if ((queue)->dhead != (queue)->dtail)
+		{
+			pkt = &(queue)->deq[(queue)->dhead & (queue)->mask];
+			FIFO_STORE((queue)->dhead, (queue)->dhead + 1);
+			FIFO_STORE((queue)->bytes_out, (queue)->bytes_out + pkt->len);
+			FIFO_STORE((queue)->segs_out, (queue)->segs_out + pkt->segs);
+			FIFO_STORE((queue)->pkts_out, (queue)->pkts_out + 1);
+			nfq_set_verdict((queue)->qh, pkt->id, NF_DROP, 0, NULL);
+			free(pkt->data);
+			pkt->data = NULL;
+		}
+	}
+}
+
+
+/**
+ * Forget the oldest packets of the queue without issuing verdicts.
+ *
+ * Used when the kernel no longer holds packets the queue still counts, e.g. after it flushed the netfilter queue.  The
+ * oldest packets are the ones most likely to be gone.  Only to be called from the releasing thread.
+ *
+ * \param queue The queue.
+ * \param count Number of packets to forget.
+ *
+ * \return Number of packets forgotten.
+ */
+uint32_t fifo_forget(fifo_t *queue, uint32_t count)
+{
+	fifo_pkt_t *pkt;
+	uint32_t n;
+
+	if (!queue)
+	{
+		return 0;
+	}
+
+	fifo_drain(queue);
+	for (n = 0; n < count && (queue)->dhead != (queue)->dtail; n++)
 	{
-		(queue)->head += 1;
-		nfq_set_verdict((queue)->qh, (queue)->head, NF_DROP, 0, NULL);
+		pkt = &(queue)->deq[(queue)->dhead & (queue)->mask];
+		FIFO_STORE((queue)->dhead, (queue)->dhead + 1);
+		FIFO_STORE((queue)->bytes_out, (queue)->bytes_out + pkt->len);
+		FIFO_STORE((queue)->segs_out, (queue)->segs_out + pkt->segs);
+		FIFO_STORE((queue)->pkts_out, (queue)->pkts_out + 1);
+		free(pkt->data);
+		pkt->data = NULL;
 	}
+
+	FIFO_STORE((queue)->lost, (queue)->lost + n);
+	return n;
 }
 
 
 /**
  * Returns the number of packets currently enqueued.
  *
+ * Safe to call from any thread without holding a lock.
+ *
  * \param queue The queue whose length will be reported.
  *
  * \return Number of packets.
  */
 inline uint32_t fifo_length(fifo_t *queue)
 {
-	uint32_t length = 0;
-	if ((queue)->head < (queue)->tail)
+	uint32_t out;
+	if (!queue)
+	{
+		return 0;
+	}
+	/* both counters only grow, so a packet moving from the ring to the deque is counted exactly once */
+	out = FIFO_LOAD((queue)->pkts_out);
+
+	return FIFO_LOAD((queue)->tail) - out;
+}
+
+
+/**
+ * Returns the number of bytes currently enqueued.
+ *
+ * Safe to call from any thread without holding a lock.
+ *
+ * \param queue The queue whose length will be reported.
+ *
+ * \return Number of bytes.
+ */
+uint32_t fifo_bytes(fifo_t *queue)
+{
+	uint32_t out;
+	if (!queue)
+	{
+		return 0;
+	}
+	out = FIFO_LOAD((queue)->bytes_out);
+
+	return FIFO_LOAD((queue)->bytes_in) - out;
+}
+
+
+/**
+ * Returns the number of segments currently enqueued, equal to the number of packets unless GSO packets are counted.
+ *
+ * Safe to call from any thread without holding a lock.
+ *
+ * \param queue The queue whose length will be reported.
+ *
+ * \return Number of segments.
+ */
+uint32_t fifo_segments(fifo_t *queue)
+{
+	uint32_t out;
+	if (!queue)
+	{
+		return 0;
+	}
+	out = FIFO_LOAD((queue)->segs_out);
+
+	return FIFO_LOAD((queue)->segs_in) - out;
+}
+
+
+/**
+ * Returns how long the oldest packet of the queue has waited, its head-of-line delay.
+ *
+ * Safe to call from any thread without holding a lock.  The oldest packet is read without synchronizing with the
+ * releasing thread, so while packets are being released the delay of a slightly younger packet may be returned.
+ *
+ * \param queue The queue whose delay will be reported.
+ *
+ * \return Head-of-line delay (useconds), zero if the queue is empty.
+ */
+uint64_t fifo_hol_delay(fifo_t *queue)
+{
+	uint32_t head, dhead;
+	uint64_t tstamp, now;
+	if (!queue)
+	{
+		return 0;
+	}
+
+	/* packets are held in arrival order, the deque's front being the oldest, then the ring's */
+	dhead = FIFO_LOAD((queue)->dhead);
+	head = FIFO_LOAD((queue)->head);
+	if (dhead != FIFO_LOAD((queue)->dtail))
+	{
+		tstamp = FIFO_LOAD((queue)->deq[dhead & (queue)->mask].tstamp);
+	}
+	else if (head != FIFO_LOAD((queue)->tail))
+	{
+		tstamp = FIFO_LOAD((queue)->ring[head & (queue)->mask].tstamp);
+	}
+	else
+	{
+		return 0;
+	}
+
+	now = monotime_usec();
+	return (now > tstamp) ? now - tstamp : 0;
+}
+
+
+/**
+ * Returns the free-running count of bytes released or dropped from the queue.  The difference between two calls
+ * around a send, modulo 2^32, is the number of bytes it sent.
+ *
+ * \param queue The queue.
+ *
+ * \return Number of bytes, wrapping around.
+ */
+uint32_t fifo_bytes_out(fifo_t *queue)
+{
+	if (!queue)
+	{
+		return 0;
+	}
+	return FIFO_LOAD((queue)->bytes_out);
+}
+
+
+/**
+ * Returns the free-running count of segments released or dropped from the queue.
+ *
+ * \see fifo_bytes_out
+ *
+ * \param queue The queue.
+ *
+ * \return Number of segments, wrapping around.
+ */
+uint32_t fifo_segments_out(fifo_t *queue)
+{
+	if (!queue)
 	{
-		length = (queue)->tail - (queue)->head;
+		return 0;
 	}
-	
-	return length;
+	return FIFO_LOAD((queue)->segs_out);
+}
+
+
+/**
+ * Returns the number of packet IDs skipped because the kernel dropped the packet or its enqueue notification.
+ *
+ * \param queue The queue whose overruns will be reported.
+ *
+ * \return Number of overruns.
+ */
+uint32_t fifo_overruns(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->overruns) : 0;
+}
+
+
+/**
+ * Returns the number of packets dropped because the queue was full.
+ *
+ * \param queue The queue whose overflows will be reported.
+ *
+ * \return Number of overflows.
+ */
+uint32_t fifo_overflows(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->overflows) : 0;
+}
+
+
+/**
+ * Returns the number of packets dropped by the AQM.
+ *
+ * \param queue The queue whose AQM drops will be reported.
+ *
+ * \return Number of AQM drops.
+ */
+uint32_t fifo_aqm_drops(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->aqm_drops) : 0;
+}
+
+
+/**
+ * Returns the number of packets forgotten because the kernel no longer held them.
+ *
+ * \param queue The queue whose lost packets will be reported.
+ *
+ * \return Number of lost packets.
+ */
+uint32_t fifo_lost(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->lost) : 0;
+}
+
+
+/**
+ * Returns the number of packets marked with ECN CE.
+ *
+ * \param queue The queue whose ECN marks will be reported.
+ *
+ * \return Number of ECN marks.
+ */
+uint32_t fifo_ecn_marks(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->ecn_marks) : 0;
+}
+
+
+/**
+ * Returns the number of locally originated packets not admitted.
+ *
+ * \param queue The queue whose rejected packets will be reported.
+ *
+ * \return Number of rejected packets.
+ */
+uint32_t fifo_rejected(fifo_t *queue)
+{
+	return (queue) ? FIFO_LOAD((queue)->rejected) : 0;
 }
 
 
 /**
- * Drops all currently enqueued packets in preparation for freeing memory.
+ * Drops all currently enqueued packets and frees storage in preparation for freeing memory.
  * 
  * \param queue The queue to drop all packets from.
  */
 void fifo_delete(fifo_t *queue)
 {
-	while ((queue) && ((queue)->head < (queue)->tail))
+	if (queue)
 	{
-		(queue)->head += 1;
-		nfq_set_verdict((queue)->qh, (queue)->head, NF_DROP, 0, NULL);
+		while (fifo_length(queue) > 0)
+		{
+			fifo_drop_packet(queue);
+		}
+		free((queue)->ring);
+		free((queue)->deq);
+		(queue)->ring = NULL;
+		(queue)->deq = NULL;
 	}
 }
 
 
 /**
- * Prints the id for all packets currently in the queue.
+ * Prints the id for all packets currently in the queue, oldest first.
  *
  * \param queue The queue to be printed.
  */
 void fifo_print(fifo_t *queue)
 {
-	uint32_t i = 0;
+	uint32_t i, tail;
 	if (queue)
 	{
-		for (i = (queue)->head+1; i <= (queue)->tail; i++)
+		for (i = (queue)->dhead; i != (queue)->dtail; i++)
+		{
+			printf("pkt: %u\n", (queue)->deq[i & (queue)->mask].id);
+		}
+		tail = FIFO_LOAD((queue)->tail);
+		for (i = FIFO_LOAD((queue)->head); i != tail; i++)
 		{
-			printf("pkt: %u\n", i);
+			printf("pkt: %u\n", (queue)->ring[i & (queue)->mask].id);
 		}
 	}
 }
@@ -12,9 +12,12 @@
 /*
  * fifo_queue.h
  *
- * A simple FIFO queue for libnetfilter_queue is maintained by keeping
- * track of the id the most recently seen packet and the id of the
- * most recently accepted/dropped packet.
+ * A queue for libnetfilter_queue is maintained by keeping the ids of
+ * packets currently held in the kernel.  A single backlogger thread
+ * adds to the tail of a preallocated ring, and a single releasing
+ * thread moves packets from the ring into a deque it owns and serves
+ * them in FIFO, LIFO or hybrid order.  Neither side takes a lock.
+ * Packets that wait too long may be dropped by a CoDel-style AQM.
  */
 
 #ifndef __FIFO_QUEUE_H
@@ -23,24 +26,115 @@
 #include <stdint.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
+#include "flowlet.h"
+
 
 typedef struct nfq_q_handle nfq_qh_t;
 typedef struct nfgenmsg nfgenmsg_t;
 typedef struct nfq_data nfq_data_t;
 
+typedef enum bprd_fifo_discipline {
+	FIFO_DISC_FIFO = 0,
+	FIFO_DISC_LIFO,
+	FIFO_DISC_HYBRID
+} fifo_disc_t;
+
+typedef struct bprd_fifo_pkt {
+	uint32_t id;
+	uint32_t len;
+	uint32_t segs;
+	uint32_t flow;
+	uint64_t tstamp;
+	unsigned char *data;
+} fifo_pkt_t;
+
 typedef struct bprd_simple_fifo {
+	fifo_pkt_t *ring;
+	uint32_t mask;
 	uint32_t head;
 	uint32_t tail;
 
+	fifo_pkt_t *deq;
+	uint32_t dhead;
+	uint32_t dtail;
+	fifo_disc_t disc;
+	uint64_t deadline;
+
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t segs_in;
+	uint32_t segs_out;
+	uint32_t pkts_out;
+	uint32_t mtu;
+	uint32_t hdr;
+
+	uint32_t limit;
+	uint64_t target;
+	uint64_t interval;
+	uint64_t first_above;
+	uint64_t drop_next;
+	uint32_t drop_count;
+	uint32_t drop_last;
+	int dropping;
+	uint32_t aqm_drops;
+
+	int shared;
+	uint32_t last_id;
+	uint32_t overruns;
+	uint32_t overflows;
+	uint32_t lost;
+	int fail_open;
+	int marking;
+	uint32_t mark;
+	flowlet_table_t *flowlets;
+	uint32_t ecn_backlog;
+	uint64_t ecn_sojourn;
+	uint32_t ecn_marks;
+	uint32_t admit_v;
+	int admit_bytes;
+	uint32_t rejected;
+	uint32_t shadow_pct;
+	int shadow_bytes;
+	uint64_t shadow_in;
+	uint64_t shadow_out;
+
 	nfq_qh_t *qh;
 } fifo_t;
 
 
-extern void fifo_init(fifo_t *queue);
+extern int fifo_init(fifo_t *queue, uint32_t size);
+extern void fifo_set_discipline(fifo_t *queue, fifo_disc_t disc, uint64_t deadline);
+extern void fifo_set_aqm(fifo_t *queue, uint64_t target, uint64_t interval, uint32_t limit);
+extern uint32_t fifo_aqm(fifo_t *queue);
+extern void fifo_set_shared(fifo_t *queue);
+extern void fifo_set_gso(fifo_t *queue, uint32_t mtu, uint32_t hdr);
+extern void fifo_set_fail_open(fifo_t *queue);
+extern void fifo_set_mark(fifo_t *queue, uint32_t mark);
+extern void fifo_set_flowlets(fifo_t *queue, flowlet_table_t *ft);
+extern void fifo_set_ecn(fifo_t *queue, uint32_t backlog, uint64_t sojourn);
+extern void fifo_set_admission(fifo_t *queue, uint32_t v, int bytes);
+extern void fifo_set_shadow(fifo_t *queue, uint32_t pct, int bytes);
+extern uint32_t fifo_shadow(fifo_t *queue);
+extern void fifo_shadow_serve(fifo_t *queue, uint32_t amount);
 extern int fifo_add_packet(nfq_qh_t *qh, nfgenmsg_t *nfmsg, nfq_data_t *nfa, void *data);
+extern void fifo_enqueue(fifo_t *queue, nfq_qh_t *qh, nfgenmsg_t *nfmsg, nfq_data_t *nfa, uint32_t id);
 extern void fifo_send_packet(fifo_t *queue);
+extern uint32_t fifo_send_packets(fifo_t *queue, uint32_t count);
+extern uint32_t fifo_send_bytes(fifo_t *queue, uint32_t count, uint32_t bytes);
 extern void fifo_drop_packet(fifo_t *queue);
+extern uint32_t fifo_forget(fifo_t *queue, uint32_t count);
 extern inline uint32_t fifo_length(fifo_t *queue);
+extern uint32_t fifo_bytes(fifo_t *queue);
+extern uint32_t fifo_segments(fifo_t *queue);
+extern uint64_t fifo_hol_delay(fifo_t *queue);
+extern uint32_t fifo_bytes_out(fifo_t *queue);
+extern uint32_t fifo_segments_out(fifo_t *queue);
+extern uint32_t fifo_overruns(fifo_t *queue);
+extern uint32_t fifo_overflows(fifo_t *queue);
+extern uint32_t fifo_aqm_drops(fifo_t *queue);
+extern uint32_t fifo_lost(fifo_t *queue);
+extern uint32_t fifo_ecn_marks(fifo_t *queue);
+extern uint32_t fifo_rejected(fifo_t *queue);
 extern void fifo_delete(fifo_t *queue);
 extern void fifo_print(fifo_t *queue);
 
@@ -0,0 +1,207 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup flowlet Flowlet
+ * This module pins the packets of a flow to one next hop for as long as they keep coming back to back.
+ *
+ * Packets of a transport flow released less than a gap apart form a flowlet.  Every packet of a flowlet is marked for
+ * the next hop its first packet was marked for, so a change of gradient only moves a flow once it pauses for longer
+ * than the gap, by which time its earlier packets have most likely left the old path, and the flow is not reordered.
+ * Flows are tracked in a fixed-size table indexed by a hash of their 5-tuple; flows sharing a slot share a flowlet.
+ * \{
+ */
+
+#include "flowlet.h"
+
+#include <assert.h>         /* for assert() */
+#include <netinet/in.h>     /* for AF_INET* */
+#include <stdlib.h>         /* for calloc() */
+
+#include "classifier.h"
+
+
+#define FLOWLET_FNV_OFFSET 2166136261u  /**< FNV-1a offset basis. */
+#define FLOWLET_FNV_PRIME 16777619u     /**< FNV-1a prime. */
+
+
+/**
+ * \struct flowlet
+ * A slot of the flowlet table.
+ * \var flowlet::flow
+ * Hash of the flow that started the flowlet.
+ * \var flowlet::mark
+ * Mark of the flowlet's packets.
+ * \var flowlet::last
+ * Time the flowlet's last packet was released (useconds), zero if the slot was never used.
+ */
+
+
+/**
+ * \struct flowlet_table
+ * Flowlets of the released packets, only to be used by the releasing thread.
+ * \var flowlet_table::slots
+ * Flowlets, indexed by flow hash.
+ * \var flowlet_table::mask
+ * Number of slots less one, a power of two less one.
+ * \var flowlet_table::gap
+ * Idle time after which a flow starts a new flowlet (useconds).
+ * \var flowlet_table::flowlets
+ * Number of flowlets started, each following the gradient of its time.
+ * \var flowlet_table::pinned
+ * Number of packets kept on their flowlet's next hop rather than the best one, each a reordering avoided.
+ * \var flowlet_table::collisions
+ * Number of packets pinned to the flowlet of another flow hashing to the same slot.
+ */
+
+
+/**
+ * Initialize an empty flowlet table.
+ *
+ * \param ft The flowlet table.
+ * \param size Number of flows tracked, rounded up to a power of two.
+ * \param gap Idle time after which a flow starts a new flowlet (useconds).
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+int flowlet_init(flowlet_table_t *ft, uint32_t size, uint64_t gap) {
+
+    uint32_t n = 1;
+
+    assert(ft);
+
+    while (n < size && n < (1u << 31)) {
+        n <<= 1;
+    }
+
+    if ((ft->slots = (flowlet_t *)calloc(n, sizeof(flowlet_t))) == NULL) {
+        return -1;
+    }
+    ft->mask = n - 1;
+    ft->gap = gap;
+    ft->flowlets = 0;
+    ft->pinned = 0;
+    ft->collisions = 0;
+
+    return 0;
+}
+
+
+/**
+ * Hash the 5-tuple of a packet.
+ *
+ * \param pkt Start of the packet's IP header.
+ * \param len Number of bytes available at \a pkt.
+ *
+ * \returns Hash of the packet's addresses, protocol and ports.
+ */
+uint32_t flowlet_hash(const uint8_t *pkt, int len) {
+
+    classifier_key_t key;
+    const uint8_t *fields[] = {key.src, key.dst};
+    uint32_t h = FLOWLET_FNV_OFFSET;
+    size_t i, j;
+
+    if (len < 1 || classifier_parse(&key, pkt, len, (pkt[0] >> 4) == 6 ? AF_INET6 : AF_INET) < 0) {
+        return h;
+    }
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        for (j = 0; j < sizeof(key.src); j++) {
+            h = (h ^ fields[i][j]) * FLOWLET_FNV_PRIME;
+        }
+    }
+    h = (h ^ (key.sport >> 8)) * FLOWLET_FNV_PRIME;
+    h = (h ^ (key.sport & 0xff)) * FLOWLET_FNV_PRIME;
+    h = (h ^ (key.dport >> 8)) * FLOWLET_FNV_PRIME;
+    h = (h ^ (key.dport & 0xff)) * FLOWLET_FNV_PRIME;
+    h = (h ^ key.proto) * FLOWLET_FNV_PRIME;
+
+    return h;
+}
+
+
+/**
+ * Find the mark of a packet being released.
+ *
+ * \param ft The flowlet table.
+ * \param flow Hash of the packet's flow (\see flowlet_hash).
+ * \param mark Mark of the best next hop right now.
+ * \param now Current time (useconds).
+ *
+ * \returns The mark of the packet's flowlet, \a mark if the packet starts a new flowlet.
+ */
+uint32_t flowlet_mark(flowlet_table_t *ft, uint32_t flow, uint32_t mark, uint64_t now) {
+
+    flowlet_t *f = &ft->slots[flow & ft->mask];
+
+    if (f->last && now - f->last <= ft->gap) {
+        /* packet of an active flowlet, stay on its next hop */
+        if (f->flow != flow) {
+            __atomic_add_fetch(&ft->collisions, 1, __ATOMIC_RELAXED);
+        }
+        if (f->mark != mark) {
+            __atomic_add_fetch(&ft->pinned, 1, __ATOMIC_RELAXED);
+        }
+        f->last = now;
+        return f->mark;
+    }
+
+    /* new flowlet, follow the gradient */
+    f->flow = flow;
+    f->mark = mark;
+    f->last = now;
+    __atomic_add_fetch(&ft->flowlets, 1, __ATOMIC_RELAXED);
+
+    return mark;
+}
+
+
+/**
+ * Returns the number of flowlets started.
+ *
+ * \param ft The flowlet table.
+ *
+ * \return Number of flowlets.
+ */
+uint32_t flowlet_flowlets(flowlet_table_t *ft) {
+
+    return __atomic_load_n(&ft->flowlets, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the number of packets kept on their flowlet's next hop rather than the best one.
+ *
+ * \param ft The flowlet table.
+ *
+ * \return Number of pinned packets.
+ */
+uint32_t flowlet_pinned(flowlet_table_t *ft) {
+
+    return __atomic_load_n(&ft->pinned, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the number of packets that joined the flowlet of another flow hashing to the same slot.
+ *
+ * \param ft The flowlet table.
+ *
+ * \return Number of collisions.
+ */
+uint32_t flowlet_collisions(flowlet_table_t *ft) {
+
+    return __atomic_load_n(&ft->collisions, __ATOMIC_RELAXED);
+}
+
+/** \} */
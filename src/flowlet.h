@@ -0,0 +1,39 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __FLOWLET_H
+#define __FLOWLET_H
+
+#include <stdint.h>             /* for uint*_t */
+
+typedef struct flowlet {
+    uint32_t flow;
+    uint32_t mark;
+    uint64_t last;
+} flowlet_t;
+
+typedef struct flowlet_table {
+    flowlet_t *slots;
+    uint32_t mask;
+    uint64_t gap;
+    uint32_t flowlets;
+    uint32_t pinned;
+    uint32_t collisions;
+} flowlet_table_t;
+
+extern int flowlet_init(flowlet_table_t *ft, uint32_t size, uint64_t gap);
+extern uint32_t flowlet_hash(const uint8_t *pkt, int len);
+extern uint32_t flowlet_mark(flowlet_table_t *ft, uint32_t flow, uint32_t mark, uint64_t now);
+extern uint32_t flowlet_flowlets(flowlet_table_t *ft);
+extern uint32_t flowlet_pinned(flowlet_table_t *ft);
+extern uint32_t flowlet_collisions(flowlet_table_t *ft);
+
+#endif /* __FLOWLET_H */
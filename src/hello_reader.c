@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>         /* for memset() */
 #include <pthread.h>
 #include <sys/time.h>       /* for gettimeofday() */
 
@@ -24,6 +25,7 @@
 #include "ntable.h"
 #include "neighbor.h"
 #include "commodity.h"
+#include "router.h"
 
 
 static struct pbb_reader pbb_r;
@@ -39,6 +41,9 @@ void hello_recv(uint8_t *buf, size_t buflen) {
     //ntable_print(&bprd.ntable);
 
     pbb_reader_handle_packet(&pbb_r, buf, buflen);
+
+    /* hand the neighbor's new backlogs to the releasing thread */
+    router_publish();
     
     //printf("\n\nAfter Message Reception:\n");
     //ntable_print(&bprd.ntable);
@@ -47,6 +52,7 @@ void hello_recv(uint8_t *buf, size_t buflen) {
 
 
 static neighbor_t *n = NULL;
+static uint32_t unknown_tlvs = 0;     /**< TLVs skipped for being of an unknown type or length. */
 
 static enum pbb_result hello_cons_msg_start (struct pbb_reader_tlvblock_consumer *c __attribute__ ((unused)), 
                                           struct pbb_reader_tlvblock_context *context) {
@@ -85,23 +91,37 @@ static enum pbb_result hello_cons_msg_tlv(struct pbb_reader_tlvblock_consumer *c
 
     commodity_t *com;
     commodity_t comtemp;
+    commodity_b_t bdata;
 
-    /* read in commodities for the neighbor */
-    if (tlv->type == BPRD_MSGTLV_TYPE_COM && tlv->length == sizeof(commodity_s_t)) {
-        /** \todo hton byteorder worries here?! */
+    /* read in commodities for the neighbor, whole or as older versions send them */
+    /** \todo hton byteorder worries here?! */
+    if (tlv->type == BPRD_MSGTLV_TYPE_COMEXT && tlv->length == sizeof(commodity_s_t)) {
         comtemp.cdata = *(commodity_s_t *)tlv->single_value;
-        /* try to find commodity in neighbor commodity list or create new one */
-        com = clist_find(&n->clist, &comtemp);
-        if (com == NULL) {
-            com = (commodity_t *)malloc(sizeof(commodity_t));
-            memset(com, 0, sizeof(commodity_t));
-            com->cdata.addr = comtemp.cdata.addr;
-            list_insert(&n->clist, com);
-        }
-        com->cdata.backlog = comtemp.cdata.backlog;
+    } else if (tlv->type == BPRD_MSGTLV_TYPE_COM && tlv->length == sizeof(commodity_b_t)) {
+        bdata = *(commodity_b_t *)tlv->single_value;
+        memset(&comtemp.cdata, 0, sizeof(comtemp.cdata));
+        comtemp.cdata.addr = bdata.addr;
+        comtemp.cdata.backlog = bdata.backlog;
     } else {
-        BPRD_LOG_ERR("Unrecognized TLV parameters");
+        /* a TLV of a newer version, skipped so that nodes can be upgraded one at a time */
+        if (!unknown_tlvs++) {
+            BPRD_LOG_WARN("Skipping unrecognized TLV (type %u, length %u)", tlv->type, tlv->length);
+        }
+        return PBB_OKAY;
+    }
+
+    /* try to find commodity in neighbor commodity list or create new one */
+    com = clist_find(&n->clist, &comtemp);
+    if (com == NULL) {
+        com = (commodity_t *)malloc(sizeof(commodity_t));
+        memset(com, 0, sizeof(commodity_t));
+        com->cdata.addr = comtemp.cdata.addr;
+        com->cdata.cls = comtemp.cdata.cls;
+        list_insert(&n->clist, com);
     }
+    com->cdata.backlog = comtemp.cdata.backlog;
+    com->cdata.backlog_bytes = comtemp.cdata.backlog_bytes;
+    com->cdata.hol = comtemp.cdata.hol;
 
     return PBB_OKAY;
 }
@@ -25,6 +25,8 @@
 #include "logger.h"
 #include "commodity.h"
 #include "neighbor.h"
+#include "router.h"
+#include "scheduler.h"
 
 static struct pbb_writer pbb_w;
 static struct pbb_writer_interface pbb_iface;
@@ -82,11 +84,20 @@ static void hello_add_msgtlvs(struct pbb_writer *w, struct pbb_writer_content_pr
     elm_t *e;
     commodity_t *c;
     commodity_s_t cdata;
+    commodity_b_t bdata;
+    memset(&bdata, 0, sizeof(bdata));
     for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
         c = (commodity_t *)e->data;
         cdata = c->cdata;
         /* TODO: hton byteorder worries here?! */
-        pbb_writer_add_messagetlv(w, BPRD_MSGTLV_TYPE_COM, 0, &cdata, sizeof(commodity_s_t));
+        /* keep to the layout older versions read unless the commodity needs more than its packet backlog */
+        if (cdata.cls == 0 && bprd.backlog_units == BPRD_UNITS_PACKETS && bprd.pressure == BPRD_PRESSURE_BACKLOG) {
+            bdata.addr = cdata.addr;
+            bdata.backlog = cdata.backlog;
+            pbb_writer_add_messagetlv(w, BPRD_MSGTLV_TYPE_COM, 0, &bdata, sizeof(commodity_b_t));
+        } else {
+            pbb_writer_add_messagetlv(w, BPRD_MSGTLV_TYPE_COMEXT, 0, &cdata, sizeof(commodity_s_t));
+        }
         //pbb_writer_add_messagetlv(w, BPRD_MSGTLV_TYPE_COMKEY, 0, &c->addr.addr, addr_len);
         //pbb_writer_add_messagetlv(w, BPRD_MSGTLV_TYPE_BACKLOG, 0, &c->backlog, sizeof(c->backlog));
     }   
@@ -100,6 +111,8 @@ static void hello_add_addresses(struct pbb_writer *w, struct pbb_writer_content_
     ntable_mutex_lock(&bprd.ntable);
     /* refresh neighbor list */
     ntable_refresh(&bprd.ntable); 
+    /* stop releasing to neighbors that timed out */
+    router_publish();
     /* add my neighbors to message */
     elm_t *e;
     neighbor_t *n;
@@ -177,8 +190,7 @@ static void *hello_writer_thread(void *arg __attribute__((unused)) ) {
         pbb_writer_create_message(&pbb_w, BPRD_MSG_TYPE_HELLO, useAllIf, NULL);
         pbb_writer_flush(&pbb_w, &pbb_iface, false);
 
-        /** \todo change to nanosleep() */
-        usleep(bprd.hello_interval);
+        scheduler_sleep(bprd.hello_interval, SCHEDULER_PHASE_HELLO);
     }
 
     return NULL;
@@ -24,6 +24,13 @@
 #include <syslog.h>
 
 
+/**
+ * \def BPRD_LOG_WARN(fmt,...) Logs a warning message and carries on.
+ * \param fmt Printf-style format string.
+ * \param ... Arguments corresponding to format string \a fmt.
+ */
+
+
 /**
  * \def BPRD_LOG_ERR(fmt,...) Logs an error message and exits.
  * \param fmt Printf-style format string.
@@ -15,6 +15,7 @@
 #include <syslog.h>     /* for priority definitions, ex. LOG_ERR */
 
 #define BPRD_LOG_INFO(fmt,...) logger_log(LOG_INFO,NULL,0,(fmt),##__VA_ARGS__)
+#define BPRD_LOG_WARN(fmt,...) logger_log(LOG_WARNING,__FILE__,__LINE__,(fmt),##__VA_ARGS__)
 #define BPRD_LOG_ERR(fmt,...) logger_log(LOG_ERR,__FILE__,__LINE__,(fmt),##__VA_ARGS__)
 #define BPRD_LOG_DBG(fmt,...) logger_log(LOG_DEBUG,__FILE__,__LINE__,(fmt),##__VA_ARGS__)
 
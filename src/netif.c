@@ -12,6 +12,10 @@
 #include "netif.h"
 
 #include <net/if.h>
+#include <string.h>         /* for strncpy() */
+#include <sys/ioctl.h>      /* for ioctl(), SIOCGIFMTU */
+#include <sys/socket.h>     /* for socket() */
+#include <unistd.h>         /* for close() */
 
 /* Note that <netlink/route/link.h> includes <linux/if.h> which collides with <net/if.h>.
  * Instead of writing out our dependency on <net/if.h> by using the newer available functions
@@ -27,3 +31,21 @@ unsigned int netif_nametoindex (const char *__ifname) {
 char *netif_indextoname (unsigned int __ifindex, char *__ifname) {
   return if_indextoname(__ifindex, __ifname);
 }
+
+
+/* Maximum transmission unit of an interface, or -1 on error.  */
+int netif_mtu (const char *__ifname) {
+  struct ifreq ifr;
+  int fd, ret;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    return -1;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, __ifname, IFNAMSIZ - 1);
+  ret = (ioctl(fd, SIOCGIFMTU, &ifr) < 0) ? -1 : ifr.ifr_mtu;
+
+  close(fd);
+  return ret;
+}
@@ -18,6 +18,9 @@
 extern unsigned int netif_nametoindex (const char *__ifname);
 extern char *netif_indextoname (unsigned int __ifindex, char *__ifname);
 
+/* Maximum transmission unit of an interface, or -1 on error.  */
+extern int netif_mtu (const char *__ifname);
+
 /* Length of interface name.  */
 #define NETIF_NAMESIZE	16
 
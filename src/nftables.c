@@ -0,0 +1,540 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup nftables nftables
+ * This module installs the rules that steer commodity packets into their netfilter queues.
+ *
+ * All rules live in a table of their own, NFTABLES_TABLE, so rules belonging to anyone else are left alone.  The
+ * table holds a map from destination address to netfilter queue number and two base chains, hooked in front of
+ * connection tracking at the raw priority, each with a single rule that queues packets to the number the map gives
+ * for their destination.  When commodities share netfilter queues, the map is replaced by a set of destination
+ * addresses and the rule picks a queue by hashing the destination, so that all packets of a commodity arrive on the
+ * same queue.  The table is replaced with a single nfnetlink batch, which the kernel applies atomically,
+ * so startup costs one system call however many commodities there are and no partial ruleset is ever visible.
+ * \{
+ */
+
+#include "nftables.h"
+
+#include <arpa/inet.h>      /* for htonl(), htons() */
+#include <stdint.h>
+#include <stdlib.h>         /* for realloc(), free() */
+#include <string.h>         /* for memcpy() */
+#include <sys/queue.h>      /* for LIST_*() */
+#include <sys/socket.h>     /* must come before linux/netlink.h so sa_family_t is defined */
+
+#include <linux/netlink.h>                  /* for NETLINK_NETFILTER */
+#include <linux/netfilter.h>                /* for NF_ACCEPT, NF_INET_* */
+#include <linux/netfilter/nfnetlink.h>      /* for NFNL_MSG_BATCH_*, NFNL_SUBSYS_NFTABLES */
+#include <linux/netfilter/nf_tables.h>      /* for NFT_MSG_*, NFTA_* */
+
+#include <netlink/attr.h>                   /* for nla_put*(), nla_nest_*() */
+#include <netlink/msg.h>                    /* for nlmsg_*() */
+#include <netlink/netlink.h>                /* for nl_connect(), nl_sendto(), nl_wait_for_ack() */
+#include <netlink/socket.h>                 /* for nl_sock, nl_socket_alloc(), nl_socket_free() */
+
+#include "commodity.h"
+
+
+#define NFTABLES_MAP "queues"             /* destination address to queue number map, or set of addresses */
+#define NFTABLES_MAP_ID 1                 /* transaction-local ID of the map */
+#define NFTABLES_PRIORITY -300            /* NF_IP_PRI_RAW, ahead of connection tracking */
+#define NFTABLES_ELEMS_PER_MSG 64         /* map elements sent per netlink message */
+
+/* datatypes as numbered by nft(8), so that `nft list ruleset` can render the map */
+#define NFTABLES_TYPE_INTEGER 4
+#define NFTABLES_TYPE_IPADDR 7
+#define NFTABLES_TYPE_IP6ADDR 8
+
+
+/**
+ * \struct nftables_batch
+ * Netlink messages collected to be sent to the kernel as one nfnetlink batch.
+ * \var nftables_batch::buf
+ * Concatenated messages.
+ * \var nftables_batch::len
+ * Length of \a buf in use (bytes).
+ * \var nftables_batch::size
+ * Length of \a buf allocated (bytes).
+ * \var nftables_batch::seq
+ * Sequence number of the next message.
+ */
+typedef struct nftables_batch {
+    char *buf;
+    size_t len;
+    size_t size;
+    uint32_t seq;
+} nftables_batch_t;
+
+
+/**
+ * Start a nf_tables netlink message.
+ *
+ * \param b The batch the message will be added to.
+ * \param type Message type, NFNL_MSG_BATCH_* or NFT_MSG_*.
+ * \param flags Netlink flags in addition to NLM_F_REQUEST.
+ * \param family Netfilter protocol family.
+ *
+ * \returns The new message, to be freed by nftables_batch_add().
+ * \retval NULL On error.
+ */
+static struct nl_msg *nftables_msg(nftables_batch_t *b, uint16_t type, uint16_t flags, uint8_t family) {
+
+    struct nl_msg *msg;
+    struct nfgenmsg *nfg;
+    int batch = (type == NFNL_MSG_BATCH_BEGIN || type == NFNL_MSG_BATCH_END);
+
+    if ((msg = nlmsg_alloc()) == NULL) {
+        return NULL;
+    }
+
+    if (nlmsg_put(msg, NL_AUTO_PORT, b->seq++, batch ? type : (NFNL_SUBSYS_NFTABLES << 8) | type, sizeof(*nfg),
+                  NLM_F_REQUEST | flags) == NULL) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    nfg = (struct nfgenmsg *)nlmsg_data(nlmsg_hdr(msg));
+    nfg->nfgen_family = batch ? AF_UNSPEC : family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = batch ? htons(NFNL_SUBSYS_NFTABLES) : 0;
+
+    return msg;
+}
+
+
+/**
+ * Append a message to a batch and free it.
+ *
+ * \param b The batch.
+ * \param msg The message, may be NULL.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error, including if \a msg is NULL.
+ */
+static int nftables_batch_add(nftables_batch_t *b, struct nl_msg *msg) {
+
+    struct nlmsghdr *nlh;
+    char *buf;
+    size_t len;
+
+    if (!msg) {
+        return -1;
+    }
+
+    nlh = nlmsg_hdr(msg);
+    len = NLMSG_ALIGN(nlh->nlmsg_len);
+    if (b->len + len > b->size) {
+        if ((buf = (char *)realloc(b->buf, 2*(b->size + len))) == NULL) {
+            nlmsg_free(msg);
+            return -1;
+        }
+        b->buf = buf;
+        b->size = 2*(b->size + len);
+    }
+
+    memcpy(b->buf + b->len, nlh, nlh->nlmsg_len);
+    memset(b->buf + b->len + nlh->nlmsg_len, 0, len - nlh->nlmsg_len);
+    b->len += len;
+    nlmsg_free(msg);
+
+    return 0;
+}
+
+
+/**
+ * Build a message creating or deleting the table.
+ *
+ * \param b The batch.
+ * \param type NFT_MSG_NEWTABLE or NFT_MSG_DELTABLE.
+ * \param family Netfilter protocol family.
+ *
+ * \returns The message.
+ * \retval NULL On error.
+ */
+static struct nl_msg *nftables_table(nftables_batch_t *b, uint16_t type, uint8_t family) {
+
+    struct nl_msg *msg;
+
+    if ((msg = nftables_msg(b, type, type == NFT_MSG_NEWTABLE ? NLM_F_CREATE : 0, family)) == NULL) {
+        return NULL;
+    }
+
+    if (nla_put_string(msg, NFTA_TABLE_NAME, NFTABLES_TABLE) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+
+/**
+ * Build a message creating the destination address to queue number map, or the set of destination addresses.
+ *
+ * \param b The batch.
+ * \param family Netfilter protocol family.
+ * \param alen Length of an address (bytes).
+ * \param map Boolean integer indicating if a map, rather than a set, is created.
+ *
+ * \returns The message.
+ * \retval NULL On error.
+ */
+static struct nl_msg *nftables_map(nftables_batch_t *b, uint8_t family, uint32_t alen, int map) {
+
+    struct nl_msg *msg;
+
+    if ((msg = nftables_msg(b, NFT_MSG_NEWSET, NLM_F_CREATE, family)) == NULL) {
+        return NULL;
+    }
+
+    if (nla_put_string(msg, NFTA_SET_TABLE, NFTABLES_TABLE) < 0 ||
+        nla_put_string(msg, NFTA_SET_NAME, NFTABLES_MAP) < 0 ||
+        nla_put_u32(msg, NFTA_SET_ID, htonl(NFTABLES_MAP_ID)) < 0 ||
+        nla_put_u32(msg, NFTA_SET_FLAGS, htonl(map ? NFT_SET_MAP : 0)) < 0 ||
+        nla_put_u32(msg, NFTA_SET_KEY_TYPE, htonl(family == NFPROTO_IPV6 ? NFTABLES_TYPE_IP6ADDR : NFTABLES_TYPE_IPADDR)) < 0 ||
+        nla_put_u32(msg, NFTA_SET_KEY_LEN, htonl(alen)) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    /* the queue expression loads a whole 32-bit register */
+    if (map && (nla_put_u32(msg, NFTA_SET_DATA_TYPE, htonl(NFTABLES_TYPE_INTEGER)) < 0 ||
+                nla_put_u32(msg, NFTA_SET_DATA_LEN, htonl(sizeof(uint32_t))) < 0)) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+
+/**
+ * Add one element to a map or set element message.
+ *
+ * \param msg The message.
+ * \param addr Destination address.
+ * \param alen Length of \a addr (bytes).
+ * \param map Boolean integer indicating if the element belongs to a map.
+ * \param qnum Netfilter queue number, ignored unless \a map.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+static int nftables_map_elem(struct nl_msg *msg, uint8_t *addr, uint32_t alen, int map, uint32_t qnum) {
+
+    struct nlattr *elem, *key, *data;
+
+    if ((elem = nla_nest_start(msg, NFTA_LIST_ELEM)) == NULL ||
+        (key = nla_nest_start(msg, NFTA_SET_ELEM_KEY)) == NULL ||
+        nla_put(msg, NFTA_DATA_VALUE, alen, addr) < 0 ||
+        nla_nest_end(msg, key) < 0) {
+        return -1;
+    }
+
+    /* queue numbers are loaded from a register in host byte order */
+    if (map && ((data = nla_nest_start(msg, NFTA_SET_ELEM_DATA)) == NULL ||
+                nla_put(msg, NFTA_DATA_VALUE, sizeof(qnum), &qnum) < 0 ||
+                nla_nest_end(msg, data) < 0)) {
+        return -1;
+    }
+
+    if (nla_nest_end(msg, elem) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Build a message creating a base chain.
+ *
+ * \param b The batch.
+ * \param family Netfilter protocol family.
+ * \param name Name of the chain.
+ * \param hook Netfilter hook to attach to.
+ *
+ * \returns The message.
+ * \retval NULL On error.
+ */
+static struct nl_msg *nftables_chain(nftables_batch_t *b, uint8_t family, const char *name, uint32_t hook) {
+
+    struct nl_msg *msg;
+    struct nlattr *nest;
+
+    if ((msg = nftables_msg(b, NFT_MSG_NEWCHAIN, NLM_F_CREATE, family)) == NULL) {
+        return NULL;
+    }
+
+    if (nla_put_string(msg, NFTA_CHAIN_TABLE, NFTABLES_TABLE) < 0 ||
+        nla_put_string(msg, NFTA_CHAIN_NAME, name) < 0 ||
+        (nest = nla_nest_start(msg, NFTA_CHAIN_HOOK)) == NULL ||
+        nla_put_u32(msg, NFTA_HOOK_HOOKNUM, htonl(hook)) < 0 ||
+        nla_put_u32(msg, NFTA_HOOK_PRIORITY, htonl((uint32_t)NFTABLES_PRIORITY)) < 0 ||
+        nla_nest_end(msg, nest) < 0 ||
+        nla_put_string(msg, NFTA_CHAIN_TYPE, "filter") < 0 ||
+        nla_put_u32(msg, NFTA_CHAIN_POLICY, htonl(NF_ACCEPT)) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+
+/**
+ * Build a message creating the rule that queues packets by destination address, i.e.
+ *
+ *     queue to ip daddr map @queues
+ *
+ * or, when \a qtotal is positive,
+ *
+ *     ip daddr @queues queue to jhash ip daddr mod qtotal offset qnum
+ *
+ * \param b The batch.
+ * \param family Netfilter protocol family.
+ * \param chain Name of the chain to add the rule to.
+ * \param flags Netlink flags in addition to NLM_F_CREATE and NLM_F_APPEND.
+ * \param qnum First shared netfilter queue.
+ * \param qtotal Number of shared netfilter queues, zero to use the map.
+ *
+ * \returns The message.
+ * \retval NULL On error.
+ */
+static struct nl_msg *nftables_rule(nftables_batch_t *b, uint8_t family, const char *chain, uint16_t flags,
+                                    uint16_t qnum, uint16_t qtotal) {
+
+    struct nl_msg *msg;
+    struct nlattr *exprs, *expr, *data;
+    uint32_t offset = (family == NFPROTO_IPV6) ? 24 : 16;
+    uint32_t alen = (family == NFPROTO_IPV6) ? 16 : 4;
+
+    if ((msg = nftables_msg(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND | flags, family)) == NULL) {
+        return NULL;
+    }
+
+    if (nla_put_string(msg, NFTA_RULE_TABLE, NFTABLES_TABLE) < 0 ||
+        nla_put_string(msg, NFTA_RULE_CHAIN, chain) < 0 ||
+        (exprs = nla_nest_start(msg, NFTA_RULE_EXPRESSIONS)) == NULL) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    /* load destination address into register 1 */
+    if ((expr = nla_nest_start(msg, NFTA_LIST_ELEM)) == NULL ||
+        nla_put_string(msg, NFTA_EXPR_NAME, "payload") < 0 ||
+        (data = nla_nest_start(msg, NFTA_EXPR_DATA)) == NULL ||
+        nla_put_u32(msg, NFTA_PAYLOAD_DREG, htonl(NFT_REG_1)) < 0 ||
+        nla_put_u32(msg, NFTA_PAYLOAD_BASE, htonl(NFT_PAYLOAD_NETWORK_HEADER)) < 0 ||
+        nla_put_u32(msg, NFTA_PAYLOAD_OFFSET, htonl(offset)) < 0 ||
+        nla_put_u32(msg, NFTA_PAYLOAD_LEN, htonl(alen)) < 0 ||
+        nla_nest_end(msg, data) < 0 ||
+        nla_nest_end(msg, expr) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    /* look up queue number into register 2, packets to other destinations stop here */
+    if ((expr = nla_nest_start(msg, NFTA_LIST_ELEM)) == NULL ||
+        nla_put_string(msg, NFTA_EXPR_NAME, "lookup") < 0 ||
+        (data = nla_nest_start(msg, NFTA_EXPR_DATA)) == NULL ||
+        nla_put_string(msg, NFTA_LOOKUP_SET, NFTABLES_MAP) < 0 ||
+        nla_put_u32(msg, NFTA_LOOKUP_SET_ID, htonl(NFTABLES_MAP_ID)) < 0 ||
+        nla_put_u32(msg, NFTA_LOOKUP_SREG, htonl(NFT_REG_1)) < 0 ||
+        (!qtotal && nla_put_u32(msg, NFTA_LOOKUP_DREG, htonl(NFT_REG_2)) < 0) ||
+        nla_nest_end(msg, data) < 0 ||
+        nla_nest_end(msg, expr) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    /* or hash destination address onto a shared queue number in register 2 */
+    if (qtotal && ((expr = nla_nest_start(msg, NFTA_LIST_ELEM)) == NULL ||
+                   nla_put_string(msg, NFTA_EXPR_NAME, "hash") < 0 ||
+                   (data = nla_nest_start(msg, NFTA_EXPR_DATA)) == NULL ||
+                   nla_put_u32(msg, NFTA_HASH_TYPE, htonl(NFT_HASH_JENKINS)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_SREG, htonl(NFT_REG_1)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_DREG, htonl(NFT_REG_2)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_LEN, htonl(alen)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_MODULUS, htonl(qtotal)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_SEED, htonl(0)) < 0 ||
+                   nla_put_u32(msg, NFTA_HASH_OFFSET, htonl(qnum)) < 0 ||
+                   nla_nest_end(msg, data) < 0 ||
+                   nla_nest_end(msg, expr) < 0)) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    /* queue to the number in register 2 */
+    if ((expr = nla_nest_start(msg, NFTA_LIST_ELEM)) == NULL ||
+        nla_put_string(msg, NFTA_EXPR_NAME, "queue") < 0 ||
+        (data = nla_nest_start(msg, NFTA_EXPR_DATA)) == NULL ||
+        nla_put_u32(msg, NFTA_QUEUE_SREG_QNUM, htonl(NFT_REG_2)) < 0 ||
+        nla_put_u16(msg, NFTA_QUEUE_FLAGS, htons(0)) < 0 ||
+        nla_nest_end(msg, data) < 0 ||
+        nla_nest_end(msg, expr) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    if (nla_nest_end(msg, exprs) < 0) {
+        nlmsg_free(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+
+/**
+ * Add messages filling the map or set with every commodity not destined to \a self.
+ *
+ * \param b The batch.
+ * \param family Netfilter protocol family.
+ * \param alen Length of an address (bytes).
+ * \param map Boolean integer indicating if a map, rather than a set, is filled.
+ * \param clist List of commodities.
+ * \param self Address of this node.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+static int nftables_map_elems(nftables_batch_t *b, uint8_t family, uint32_t alen, int map, list_t *clist,
+                              struct netaddr *self) {
+
+    struct nl_msg *msg = NULL;
+    struct nlattr *elems = NULL;
+    elm_t *e, *f;
+    commodity_t *c;
+    uint32_t n = 0;
+
+    for (e = LIST_FIRST(clist); e != NULL; e = LIST_NEXT(e, elms)) {
+        c = (commodity_t *)e->data;
+
+        /* skip commodity destined to me! */
+        if (netaddr_cmp(self, &c->cdata.addr) == 0) {
+            continue;
+        }
+
+        /* a destination is listed once, its commodities have distinct rules on the shared queues */
+        for (f = LIST_FIRST(clist); f != e && netaddr_cmp(&((commodity_t *)f->data)->cdata.addr, &c->cdata.addr) != 0;
+             f = LIST_NEXT(f, elms));
+        if (f != e) {
+            continue;
+        }
+
+        if (!msg) {
+            if ((msg = nftables_msg(b, NFT_MSG_NEWSETELEM, NLM_F_CREATE, family)) == NULL) {
+                return -1;
+            }
+            if (nla_put_string(msg, NFTA_SET_ELEM_LIST_TABLE, NFTABLES_TABLE) < 0 ||
+                nla_put_string(msg, NFTA_SET_ELEM_LIST_SET, NFTABLES_MAP) < 0 ||
+                nla_put_u32(msg, NFTA_SET_ELEM_LIST_SET_ID, htonl(NFTABLES_MAP_ID)) < 0 ||
+                (elems = nla_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS)) == NULL) {
+                nlmsg_free(msg);
+                return -1;
+            }
+        }
+
+        if (nftables_map_elem(msg, c->cdata.addr.addr, alen, map, c->nfq_id) < 0) {
+            nlmsg_free(msg);
+            return -1;
+        }
+
+        if (++n == NFTABLES_ELEMS_PER_MSG) {
+            if (nla_nest_end(msg, elems) < 0) {
+                nlmsg_free(msg);
+                return -1;
+            }
+            if (nftables_batch_add(b, msg) < 0) {
+                return -1;
+            }
+            msg = NULL;
+            n = 0;
+        }
+    }
+
+    if (msg) {
+        if (nla_nest_end(msg, elems) < 0) {
+            nlmsg_free(msg);
+            return -1;
+        }
+        return nftables_batch_add(b, msg);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Replace the bprd table with one that queues every commodity not destined to this node.
+ *
+ * The table is created, deleted and created again within one batch so that any table left behind by a previous run
+ * is dropped along with its rules.  The kernel either applies the whole batch or none of it.
+ *
+ * \param clist List of commodities.
+ * \param self Address of this node, its type selects IPv4 or IPv6.
+ * \param qnum First shared netfilter queue.
+ * \param qtotal Number of shared netfilter queues to balance commodities over by destination, zero to queue each
+ * commodity to its own nfq_id.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+int nftables_install(list_t *clist, struct netaddr *self, uint16_t qnum, uint16_t qtotal) {
+
+    nftables_batch_t b = {NULL, 0, 0, 0};
+    struct nl_sock *sk;
+    uint8_t family = (self->type == AF_INET6) ? NFPROTO_IPV6 : NFPROTO_IPV4;
+    uint32_t alen = (self->type == AF_INET6) ? 16 : 4;
+    int ret = -1;
+
+    if (nftables_batch_add(&b, nftables_msg(&b, NFNL_MSG_BATCH_BEGIN, 0, family)) < 0 ||
+        nftables_batch_add(&b, nftables_table(&b, NFT_MSG_NEWTABLE, family)) < 0 ||
+        nftables_batch_add(&b, nftables_table(&b, NFT_MSG_DELTABLE, family)) < 0 ||
+        nftables_batch_add(&b, nftables_table(&b, NFT_MSG_NEWTABLE, family)) < 0 ||
+        nftables_batch_add(&b, nftables_map(&b, family, alen, !qtotal)) < 0 ||
+        nftables_map_elems(&b, family, alen, !qtotal, clist, self) < 0 ||
+        nftables_batch_add(&b, nftables_chain(&b, family, "prerouting", NF_INET_PRE_ROUTING)) < 0 ||
+        nftables_batch_add(&b, nftables_chain(&b, family, "output", NF_INET_LOCAL_OUT)) < 0 ||
+        nftables_batch_add(&b, nftables_rule(&b, family, "prerouting", 0, qnum, qtotal)) < 0 ||
+        nftables_batch_add(&b, nftables_rule(&b, family, "output", NLM_F_ACK, qnum, qtotal)) < 0 ||
+        nftables_batch_add(&b, nftables_msg(&b, NFNL_MSG_BATCH_END, 0, family)) < 0) {
+        free(b.buf);
+        return -1;
+    }
+
+    if ((sk = nl_socket_alloc()) == NULL) {
+        free(b.buf);
+        return -1;
+    }
+
+    /* messages were numbered by hand and only the last one is acknowledged */
+    nl_socket_disable_seq_check(sk);
+
+    /* the whole batch must fit in the socket's send buffer */
+    if (nl_connect(sk, NETLINK_NETFILTER) >= 0 &&
+        nl_socket_set_buffer_size(sk, 0, (int)b.len + 4096) >= 0 &&
+        nl_sendto(sk, b.buf, b.len) >= 0 &&
+        nl_wait_for_ack(sk) >= 0) {
+        ret = 0;
+    }
+
+    nl_close(sk);
+    nl_socket_free(sk);
+    free(b.buf);
+
+    return ret;
+}
+
+/** \} */
@@ -0,0 +1,25 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __NFTABLES_H
+#define __NFTABLES_H
+
+#include <stdint.h>             /* for uint*_t */
+
+#include <common/netaddr.h>     /* for struct netaddr */
+
+#include "list.h"
+
+#define NFTABLES_TABLE "bprd"     /* name of the nftables table owned by bprd */
+
+extern int nftables_install(list_t *clist, struct netaddr *self, uint16_t qnum, uint16_t qtotal);
+
+#endif /* __NFTABLES_H */
@@ -12,6 +12,12 @@
 /**
  * \defgroup router Router
  * This module interfaces the BPRD process with the kernel's routing table to add/update/delete routes.
+ *
+ * Under BPRD_STEERING_ROUTE, the route to each commodity's destination in the main table is pointed at its best next
+ * hop every update interval.  Under BPRD_STEERING_MARK, each neighbor is instead given a firewall mark and a routing
+ * table of its own, holding a default route through the neighbor.  The router thread and the hello reader publish each
+ * commodity's backlog at every neighbor under a seqlock whenever they change, and packets are marked for the neighbor
+ * with the lowest backlog as they are released (\see router_mark).
  * \{
  */
 
@@ -23,22 +29,28 @@
                          /* http://groups.google.com/group/linux.kernel/browse_thread/thread/6de65a3145007ae5?pli=1 */
 
 #include <linux/netlink.h>              /* for NETLINK_ROUTE */
-#include <unistd.h>      /* for usleep() */
+#include <linux/fib_rules.h>            /* for FR_ACT_TO_TBL */
+#include <linux/rtnetlink.h>            /* for RT_TABLE_MAIN */
+#include <inttypes.h>    /* for PRId64 */
 #include <pthread.h>     /* for pthread_create() */
 
 #include <netlink/addr.h>               /* for nl_addr, nl_addr_build(), nl_addr_put() */
 #include <netlink/errno.h>              /* for nl_geterror() */
 #include <netlink/netlink.h>            /* for nl_connect(), nl_close() */
 #include <netlink/route/route.h>        /* for rtnl_route*, rtnl_nexthop* */
+#include <netlink/route/rule.h>         /* for rtnl_rule* */
 #include <netlink/socket.h>             /* for nl_sock, nl_socket_alloc(), nl_socket_free() */
 //#include <netlink/route/link/inet.h>    /* for ... */
 
+#include "backlogger.h"
 #include "logger.h"
 #include "procfile.h"
+#include "scheduler.h"
 #include "commodity.h"
 #include "neighbor.h"
 #include "list.h"
 #include "bprd.h"
+#include "diffheap.h"
 #include "netif.h"      /* for netif_indextoname(), NETIF_NAMESIZE */
 
 
@@ -48,6 +60,27 @@ static unsigned int router_family;      /**< Address family to route. */
 static char router_origfwd;             /**< Previous forwarding state. */
 static char router_procfile[PATH_MAX];  /**< Path to file in proc/sys controlling IP forwarding. */
 
+#define ROUTER_RULE_PRIO 1000           /**< Priority of the policy routing rules of marked packets. */
+
+
+/**
+ * \struct router_hop
+ * A neighbor given a firewall mark and a routing table, both numbered \a mark, under BPRD_STEERING_MARK.
+ * \var router_hop::addr
+ * Address of the neighbor.
+ * \var router_hop::mark
+ * Mark of packets forwarded to the neighbor.
+ */
+typedef struct router_hop {
+    struct netaddr addr;
+    uint32_t mark;
+} router_hop_t;
+
+static list_t router_hops = LIST_HEAD_INITIALIZER(router_hops); /**< Neighbors given a mark, guarded by the ntable mutex. */
+static uint32_t router_nhops;           /**< Number of neighbors given a mark. */
+
+static void router_rule_update(uint32_t mark, unsigned int family, int add);
+
 
 /**
  * Initialize the router by binding and connecting a socket to the NETLINK_ROUTE protocol and enabling IP forwarding.
@@ -154,38 +187,43 @@ static void router_cleanup() {
     /** \todo error handling */  
     procfile_write(router_procfile, NULL, router_origfwd);
 
+    /* remove the policy routing rules of marked packets, their tables are left unused */
+    elm_t *e;
+    for (e = LIST_FIRST(&router_hops); e != NULL; e = LIST_NEXT(e, elms)) {
+        router_rule_update(((router_hop_t *)e->data)->mark, router_family, 0);
+    }
+    list_free(&router_hops, free);
+
     nl_close(router_nlsk);
     nl_socket_free(router_nlsk);
 }
 
 
 /**
- * Update a route in the kernel's routing table.  
+ * Update a route in one of the kernel's routing tables.
  *
- * \param dst Address of the destination.
+ * \param dst Address of the destination.  If NULL, the default route.
  * \param nh Address of the nexthop.  If NULL, remove the route to \a dst.
  * \param family Address family.
  * \param ifindex Index of the outgoing interface.
+ * \param table The routing table.
  */
-static void router_route_update(struct sockaddr *dst, struct sockaddr *nh, unsigned int family, unsigned int ifindex) {
+static void router_route_update(struct sockaddr *dst, struct sockaddr *nh, unsigned int family, unsigned int ifindex,
+                                uint32_t table) {
 
     int err;
     struct nl_addr *nl_dst_addr, *nl_nh_addr;
     struct rtnl_route *route;
     struct rtnl_nexthop *nexthop;
-
-    /* input checking */
-    if (dst == NULL) {
-        BPRD_LOG_ERR("Destination address is empty");
-    }
+    struct in6_addr any = IN6ADDR_ANY_INIT;
 
     /* convert socket addresses to netlink abstract addresses */
     /** \note some ugly looking typecasting to first extract address from sockaddr and then to pass as (void *) */
     if (family == AF_INET6) {
-        nl_dst_addr = nl_addr_build(AF_INET6, (void *)&((struct sockaddr_in6 *)dst)->sin6_addr, sizeof(struct in6_addr));
+        nl_dst_addr = nl_addr_build(AF_INET6, (dst != NULL) ? (void *)&((struct sockaddr_in6 *)dst)->sin6_addr : (void *)&any, sizeof(struct in6_addr));
         (nh != NULL) ? nl_nh_addr = nl_addr_build(AF_INET6, (void *)&((struct sockaddr_in6 *)nh)->sin6_addr, sizeof(struct in6_addr)) : NULL;
     } else {
-        nl_dst_addr = nl_addr_build(AF_INET, (void *)&((struct sockaddr_in *)dst)->sin_addr, sizeof(struct in_addr));
+        nl_dst_addr = nl_addr_build(AF_INET, (dst != NULL) ? (void *)&((struct sockaddr_in *)dst)->sin_addr : (void *)&any, sizeof(struct in_addr));
         (nh != NULL) ? nl_nh_addr = nl_addr_build(AF_INET, (void *)&((struct sockaddr_in *)nh)->sin_addr, sizeof(struct in_addr)) : NULL;
     }
 
@@ -193,11 +231,16 @@ static void router_route_update(struct sockaddr *dst, struct sockaddr *nh, unsig
         BPRD_LOG_ERR("Unable to convert socket addresses to netlink abstract addresses");
     }
 
+    if (dst == NULL) {
+        /* default route */
+        nl_addr_set_prefixlen(nl_dst_addr, 0);
+    }
+
     /* create route and add preliminary fields */
     if ((route = rtnl_route_alloc()) == NULL ) {
         BPRD_LOG_ERR("Unable to allocate netlink route");
     }
-    rtnl_route_set_table(route,rtnl_route_str2table("main"));
+    rtnl_route_set_table(route,table);
     rtnl_route_set_scope(route,rtnl_str2scope("universe"));
     /** \todo Change from static to bprd-specific protocol number? */
     rtnl_route_set_protocol(route,rtnl_route_str2proto("static"));
@@ -228,9 +271,297 @@ static void router_route_update(struct sockaddr *dst, struct sockaddr *nh, unsig
 }
 
 
+/**
+ * Add or remove the policy routing rule sending packets with a mark to the routing table of the same number.
+ *
+ * \param mark The firewall mark and routing table.
+ * \param family Address family.
+ * \param add Boolean integer indicating if the rule is added rather than removed.
+ */
+static void router_rule_update(uint32_t mark, unsigned int family, int add) {
+
+    int err;
+    struct rtnl_rule *rule;
+
+    if ((rule = rtnl_rule_alloc()) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate netlink rule");
+    }
+    rtnl_rule_set_family(rule, family);
+    rtnl_rule_set_prio(rule, ROUTER_RULE_PRIO);
+    rtnl_rule_set_mark(rule, mark);
+    rtnl_rule_set_mask(rule, UINT32_MAX);
+    rtnl_rule_set_table(rule, mark);
+    rtnl_rule_set_action(rule, FR_ACT_TO_TBL);
+
+    if (add) {
+        /* a rule left behind by an earlier run is just as good */
+        if ((err = rtnl_rule_add(router_nlsk, rule, NLM_F_EXCL)) < 0 && err != -NLE_EXIST) {
+            BPRD_LOG_ERR("Error adding rule: %s\n", nl_geterror(err));
+        }
+    } else {
+        rtnl_rule_delete(router_nlsk, rule, 0);
+    }
+
+    rtnl_rule_put(rule);
+}
+
+
+/**
+ * Find the mark of a neighbor.  Must be called with the ntable mutex held.
+ *
+ * \param addr Address of the neighbor.
+ *
+ * \returns The neighbor's mark.
+ * \retval 0 If the neighbor has not been given a mark yet.
+ */
+static uint32_t router_hop_mark(struct netaddr *addr) {
+
+    elm_t *e;
+    router_hop_t *h;
+
+    for (e = LIST_FIRST(&router_hops); e != NULL; e = LIST_NEXT(e, elms)) {
+        h = (router_hop_t *)e->data;
+        if (netaddr_cmp(&h->addr, addr) == 0) {
+            return h->mark;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Give a neighbor a mark, unless it has one, and point the default route of its routing table at it.  Marks are never
+ * taken back, so a neighbor that times out and returns keeps its mark.  Must be called with the ntable mutex held.
+ *
+ * \param n The neighbor.
+ */
+static void router_hop_add(neighbor_t *n) {
+
+    router_hop_t *h;
+    union netaddr_socket nsaddr_nh;
+
+    if (router_hop_mark(&n->addr) != 0) {
+        return;
+    }
+
+    if ((h = (router_hop_t *)malloc(sizeof(router_hop_t))) == NULL) {
+        BPRD_LOG_ERR("Unable to allocate memory");
+    }
+    h->addr = n->addr;
+    h->mark = bprd.mark_base + router_nhops++;
+
+    netaddr_to_socket(&nsaddr_nh, &(n->addr));
+    router_route_update(NULL, &(nsaddr_nh.std), bprd.ipver, bprd.if_index, h->mark);
+    router_rule_update(h->mark, bprd.ipver, 1);
+
+    list_insert(&router_hops, h);
+}
+
+
+/**
+ * Find the best next hop of a commodity: the neighbor with the largest backlog differential, or the commodity's
+ * destination itself.  Ties are broken uniformly at random.  Only bidirectional neighbors are considered.  Must be
+ * called with the ntable mutex held.
+ *
+ * \param c The commodity, from bprd.clist.
+ * \param diff Set to the backlog differential to the next hop.
+ *
+ * \returns The next hop.
+ * \retval NULL If no neighbor is a valid next hop.
+ */
+static neighbor_t *router_next_hop(commodity_t *c, uint32_t *diff) {
+
+    elm_t *f;
+    neighbor_t *n, *nopt = NULL;
+    commodity_t *ctemp;
+    uint32_t backdiff, diffopt = 0;
+    /* tie breaker */
+    int num = 0;
+
+    /* try to find this commodity in neighbor's clist */
+    for(f = LIST_FIRST(&bprd.ntable.nlist); f != NULL; f = LIST_NEXT(f, elms)) {
+        n = (neighbor_t *)f->data;
+
+        if ((ctemp = clist_find(&n->clist, c)) == NULL) {
+            BPRD_LOG_ERR("I know about a commodity that my neighbor doesn't!");
+        }
+
+        if (!n->bidir) {
+            /* I can hear the neighbor, but not sure if I can speak to the neighbor, skip him */
+            continue;
+        }
+
+        /* differential to the neighbor's most recent hello */
+        backdiff = (commodity_backlog(c) >= commodity_backlog(ctemp)) ? commodity_backlog(c) - commodity_backlog(ctemp) : 0;
+
+        if (netaddr_cmp(&n->addr,&ctemp->cdata.addr) == 0) {
+            /* The neighbor is the commodity's destination, send to him */
+            /** \todo Fully consider the built-in assumption -> unicast commodities (single-destination) */
+            nopt = n;
+            diffopt = backdiff;
+            break;
+        }
+
+        if (backdiff < diffopt) {
+            /* we found a neighbor with smaller backlog differential, or less than zero, ignore it */
+            continue;
+        } else if (backdiff == diffopt) {
+            /* we found a neighbor with equal backlog differential */
+            num++;
+        } else {
+            /* we found a neighbor with larger backlog differential */
+            num = 1;
+        }
+
+        /* we use the following test to determine if we have a new nexthop */
+        if (((double)rand())/((double)RAND_MAX) >= ((double)(num-1))/((double)num)) {
+            /* this results in uniformly choosing amongst an unknown number of ties */
+            /* when num == 1, we always satisfy the test */
+            nopt = n;
+            diffopt = backdiff;
+        }
+    }
+
+    *diff = diffopt;
+    return nopt;
+}
+
+
+/**
+ * Publish the backlogs of a commodity at the neighbors it can be released to, for router_mark().  Only bidirectional
+ * neighbors that have been given a mark are published, and past COMMODITY_HOPS_MAX of them only those with the lowest
+ * backlogs.  Must be called with the ntable mutex held, which keeps writers from racing each other.
+ *
+ * \param c The commodity, from bprd.clist.
+ */
+static void router_hops_publish(commodity_t *c) {
+
+    elm_t *f;
+    neighbor_t *n;
+    commodity_t *ctemp;
+    commodity_hop_t hops[COMMODITY_HOPS_MAX];
+    uint32_t nhops = 0, dest = 0, mark, backlog, worst, seq, i;
+
+    for (f = LIST_FIRST(&bprd.ntable.nlist); f != NULL; f = LIST_NEXT(f, elms)) {
+        n = (neighbor_t *)f->data;
+
+        if (!n->bidir || (ctemp = clist_find(&n->clist, c)) == NULL || (mark = router_hop_mark(&n->addr)) == 0) {
+            continue;
+        }
+
+        if (netaddr_cmp(&n->addr, &c->cdata.addr) == 0) {
+            /* the neighbor is the commodity's destination, always send to him */
+            dest = mark;
+        }
+
+        backlog = commodity_backlog(ctemp);
+        if (nhops < COMMODITY_HOPS_MAX) {
+            hops[nhops].mark = mark;
+            hops[nhops++].backlog = backlog;
+            continue;
+        }
+
+        /* out of room, replace the neighbor with the largest backlog if this one's is lower */
+        for (worst = 0, i = 1; i < nhops; i++) {
+            if (hops[i].backlog > hops[worst].backlog) {
+                worst = i;
+            }
+        }
+        if (backlog < hops[worst].backlog) {
+            hops[worst].mark = mark;
+            hops[worst].backlog = backlog;
+        }
+    }
+
+    /* an odd sequence count tells the releasing thread to retry */
+    seq = c->hops_seq;
+    __atomic_store_n(&c->hops_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&c->nhops, nhops, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->hop_dest, dest, __ATOMIC_RELAXED);
+    for (i = 0; i < nhops; i++) {
+        __atomic_store_n(&c->hops[i].mark, hops[i].mark, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->hops[i].backlog, hops[i].backlog, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&c->hops_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Publish the neighbor backlogs of all my commodities under BPRD_STEERING_MARK, after the neighbor table changed.
+ * Must be called with the ntable mutex held.
+ */
+void router_publish() {
+
+    elm_t *e;
+
+    if (bprd.steering != BPRD_STEERING_MARK) {
+        return;
+    }
+
+    for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
+        router_hops_publish((commodity_t *)e->data);
+    }
+}
+
+
+/**
+ * Returns the mark of a commodity's best next hop under BPRD_STEERING_MARK: the commodity's destination if it is a
+ * neighbor, otherwise the neighbor with the lowest published backlog of it.  Ties are taken in turn.  Only called from
+ * the releasing thread, which reads the published backlogs without taking the ntable mutex.
+ *
+ * \param c The commodity, from bprd.clist.
+ *
+ * \returns The mark routing packets to the commodity's best next hop.
+ * \retval 0 If there is no next hop, or it has no routing table yet.
+ */
+uint32_t router_mark(commodity_t *c) {
+
+    uint32_t seq, nhops, dest, mark, best, backlog, i, j;
+
+    do {
+        seq = __atomic_load_n(&c->hops_seq, __ATOMIC_ACQUIRE);
+        nhops = __atomic_load_n(&c->nhops, __ATOMIC_RELAXED);
+        dest = __atomic_load_n(&c->hop_dest, __ATOMIC_RELAXED);
+        nhops = (nhops < COMMODITY_HOPS_MAX) ? nhops : COMMODITY_HOPS_MAX;
+
+        /* start the search at a rotating neighbor so that ties take turns */
+        for (mark = 0, best = UINT32_MAX, i = 0; i < nhops; i++) {
+            j = (c->hop_turn + i) % nhops;
+            backlog = __atomic_load_n(&c->hops[j].backlog, __ATOMIC_RELAXED);
+            if (mark == 0 || backlog < best) {
+                best = backlog;
+                mark = __atomic_load_n(&c->hops[j].mark, __ATOMIC_RELAXED);
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&c->hops_seq, __ATOMIC_RELAXED));
+
+    c->hop_turn++;
+
+    return dest ? dest : mark;
+}
+
+
+/**
+ * Save the max backlog differential of one of my commodities, and hand it to the releasing thread.
+ *
+ * \param c Commodity in bprd.clist.
+ * \param diff Max backlog differential of the commodity.
+ */
+static void router_set_backdiff(commodity_t *c, uint32_t diff) {
+
+    c->backdiff = diff;
+    diffheap_update(c, diff);
+}
+
+
 /**
  * Update the backlogs on each commodity.  Update the backlog differential to each neighbor for each commodity.  Update
- * the max backlog differential for each commodity.
+ * the max backlog differential for each commodity.  Differentials are computed in packets or bytes, according to
+ * bprd.backlog_units.
  */
 static void router_update() {
 
@@ -245,17 +576,27 @@ static void router_update() {
     nsaddr.std = *bprd.saddr; 
     netaddr_from_socket(&naddr, &nsaddr);
 
+    /* the hello writer and reader read my commodity levels under the mutex */
+    ntable_mutex_lock(&bprd.ntable);
+
     /* update my commodity levels */
     for(e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
         c = (commodity_t *)e->data;
-        c->cdata.backlog = fifo_length(c->queue);
+        c->cdata.backlog = fifo_segments(c->queue);
+        c->cdata.backlog_bytes = fifo_bytes(c->queue);
+        c->cdata.hol = (uint32_t)fifo_hol_delay(c->queue);
+
+        /* under shadow queues, the shadow backlog is what neighbors see and decisions are made on */
+        if (bprd.shadow && bprd.backlog_units == BPRD_UNITS_BYTES) {
+            c->cdata.backlog_bytes = fifo_shadow(c->queue);
+        } else if (bprd.shadow) {
+            c->cdata.backlog = fifo_shadow(c->queue);
+        }
 
         /* print backlog level to syslog */
-        BPRD_LOG_INFO("Commodity: %u, Backlog: %u", c->nfq_id, c->cdata.backlog);
+        BPRD_LOG_INFO("Commodity: %u, Backlog: %u, Bytes: %u", c->nfq_id, c->cdata.backlog, c->cdata.backlog_bytes);
     }
 
-    ntable_mutex_lock(&bprd.ntable);
-
     /* update backlog differential for each neighbor's commodity */
     for (e = LIST_FIRST(&bprd.ntable.nlist); e != NULL; e = LIST_NEXT(e, elms)) {
         n = (neighbor_t *)e->data;
@@ -268,14 +609,25 @@ static void router_update() {
                 BPRD_LOG_ERR("Neighbor knows about commodity that I don't!");
             }
 
-            if (ctemp->cdata.backlog >= c->cdata.backlog) {
-                c->backdiff = ctemp->cdata.backlog - c->cdata.backlog;
+            if (commodity_backlog(ctemp) >= commodity_backlog(c)) {
+                c->backdiff = commodity_backlog(ctemp) - commodity_backlog(c);
             } else {
                 c->backdiff = 0;
             } 
         }
     }
 
+    /* give every neighbor I can speak to a routing table, so that packets can be marked for any of them */
+    if (bprd.steering == BPRD_STEERING_MARK) {
+        for (e = LIST_FIRST(&bprd.ntable.nlist); e != NULL; e = LIST_NEXT(e, elms)) {
+            n = (neighbor_t *)e->data;
+            if (n->bidir) {
+                router_hop_add(n);
+            }
+        }
+        router_publish();
+    }
+
     /* find the optimal next hop for each commodity */
     /* for each commodity, also save the max backlog differential */
     for(e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
@@ -285,70 +637,28 @@ static void router_update() {
             /* the commodity is destined to me! ignore it */
             struct netaddr_str tempstr;
             BPRD_LOG_DBG("Ignoring commodity destined to: %s", netaddr_to_string(&tempstr, &c->cdata.addr));
-            c->backdiff = 0;
+            router_set_backdiff(c, 0);
             continue;
         }
 
-        /* tie breaker */
-        int num = 0;
-        diffopt = 0;
-        nopt = NULL;
-
-        /* try to find this commodity in neighbor's clist */
-        for(f = LIST_FIRST(&bprd.ntable.nlist); f != NULL; f = LIST_NEXT(f, elms)) {
-            n = (neighbor_t *)f->data;
-
-            if ((ctemp = clist_find(&n->clist, c)) == NULL) {
-                BPRD_LOG_ERR("I know about a commodity that my neighbor doesn't!");
-            }
-
-            if (!n->bidir) {
-                /* I can hear the neighbor, but not sure if I can speak to the neighbor, skip him */
-                continue;
-            }
-
-            if (netaddr_cmp(&n->addr,&ctemp->cdata.addr) == 0) {
-                /* The neighbor is the commodity's destination, send to him */
-                /** \todo Fully consider the built-in assumption -> unicast commodities (single-destination) */
-                nopt = n;
-                diffopt = ctemp->backdiff;
-                break;
-            }
-
-            if (ctemp->backdiff < diffopt) {
-                /* we found a neighbor with smaller backlog differential, or less than zero, ignore it */
-                continue;
-            } else if (ctemp->backdiff == diffopt) {
-                /* we found a neighbor with equal backlog differential */
-                num++;
-            } else {
-                /* we found a neighbor with larger backlog differential */
-                num = 1;
-            }
-
-            /* we use the following test to determine if we have a new nexthop */
-            if (((double)rand())/((double)RAND_MAX) >= ((double)(num-1))/((double)num)) {
-                /* this results in uniformly choosing amongst an unknown number of ties */
-                /* when num == 1, we always satisfy the test */
-                nopt = n;
-                diffopt = ctemp->backdiff;
-            }
-        }
-
-        union netaddr_socket nsaddr_dst, nsaddr_nh;
-        netaddr_to_socket(&nsaddr_dst, &(c->cdata.addr));
+        nopt = router_next_hop(c, &diffopt);
 
         /* if we have a valid neighbor... */
-        if (nopt) {
+        if (nopt && bprd.steering == BPRD_STEERING_MARK) {
+            /* packets are marked for the best nexthop as they are released (see router_mark) */
+            router_set_backdiff(c, diffopt);
+        } else if (nopt) {
             /* by here, we have the best nexthop for commodity c, set it */
             /* convert commodity destination and nexthop addresses from netaddr to socket */
+            union netaddr_socket nsaddr_dst, nsaddr_nh;
+            netaddr_to_socket(&nsaddr_dst, &(c->cdata.addr));
             netaddr_to_socket(&nsaddr_nh, &(nopt->addr));
-            router_route_update(&(nsaddr_dst.std), &(nsaddr_nh.std), bprd.ipver, bprd.if_index);
+            router_route_update(&(nsaddr_dst.std), &(nsaddr_nh.std), bprd.ipver, bprd.if_index, RT_TABLE_MAIN);
             /* save the max differential inside my commodity list */
-            c->backdiff = diffopt;
+            router_set_backdiff(c, diffopt);
         } else {
             /* no valid neighbors to send commodity to! */
-            c->backdiff = 0;
+            router_set_backdiff(c, 0);
         }
     }
 
@@ -391,15 +701,22 @@ static void *router_thread_main(void *arg __attribute__((unused)) ) {
         LIST_EMPTY(&bprd.clist) ? printf("\tNONE\n") : 0;
         for (e = LIST_FIRST(&bprd.clist); e != NULL; e = LIST_NEXT(e, elms)) {
             c = (commodity_t *)e->data;
-            printf("\tDest: %s \t Backlog: %u \t Max Differential: %u\n", netaddr_to_string(&naddr_str, &c->cdata.addr), c->cdata.backlog, c->backdiff);
+            printf("\tDest: %s \t Class: %u \t Weight: %u \t Backlog: %u (%u bytes) \t Queued: %u \t HOL Delay: %u us \t Max Differential: %u \t Overruns: %u \t Overflows: %u \t AQM Drops: %u \t Lost: %u \t ECN Marks: %u \t Rejected: %u\n", netaddr_to_string(&naddr_str, &c->cdata.addr), c->cdata.cls, c->weight, c->cdata.backlog, c->cdata.backlog_bytes, fifo_segments(c->queue), c->cdata.hol, c->backdiff, fifo_overruns(c->queue), fifo_overflows(c->queue), fifo_aqm_drops(c->queue), fifo_lost(c->queue), fifo_ecn_marks(c->queue), fifo_rejected(c->queue));
+        }
+        printf("Backlogger Socket Overruns: %u \t Shared Queue Overruns: %u \t Kernel Queue Drops: %u\n", backlogger_overruns(), backlogger_shared_overruns(), backlogger_kernel_drops());
+        printf("Release Lag: %u us average, %u us worst\n", scheduler_lag_avg(), scheduler_lag_max());
+        if (bprd.txq_high) {
+            printf("Transmit Queue: %" PRId64 " packets\n", scheduler_txq());
+        }
+        if (bprd.flowlet_gap) {
+            printf("Flowlets: %u \t Packets Pinned: %u \t Flowlet Collisions: %u\n", flowlet_flowlets(backlogger_flowlets()), flowlet_pinned(backlogger_flowlets()), flowlet_collisions(backlogger_flowlets()));
         }
         printf("\n");
         ntable_print(&bprd.ntable);
         printf("---------------------------------------------------\n");
         ntable_mutex_unlock(&bprd.ntable);
 
-        /** \todo change to nanosleep */
-        usleep(bprd.update_interval);
+        scheduler_sleep(bprd.update_interval, SCHEDULER_PHASE_ROUTE);
     }
 
     /** \todo clean up if while loop breaks? */
@@ -12,6 +12,12 @@
 #ifndef __ROUTER_H
 #define __ROUTER_H
 
+#include <stdint.h>
+
+#include "commodity.h"
+
 extern void router_thread_create();
+extern void router_publish();
+extern uint32_t router_mark(commodity_t *c);
 
 #endif /* __ROUTER_H */
@@ -0,0 +1,345 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup scheduler Scheduler
+ * This module paces the release of commodity packets.
+ *
+ * Releases happen on ticks scheduled at absolute times with clock_nanosleep(), so the time a release takes does not
+ * push later ticks back.  By default, up to bprd.release_count packets are released every bprd.release_interval.  With
+ * bprd.release_rate set, ticks come every 1/rate seconds, but no closer than SCHEDULER_MIN_TICK, and each releases
+ * what a token bucket filled at that rate and holding up to bprd.release_burst packets allows.  How late each tick
+ * wakes up is tracked so that release jitter can be told apart from network jitter.
+ *
+ * With bprd.txq_high set, releases instead follow the interface's transmit queue: every bprd.release_interval its root
+ * qdisc is read, releasing starts once fewer than bprd.txq_low packets are queued, and stops once bprd.txq_high are.
+ * While releasing, each tick tops the queue up to bprd.txq_high packets, at most bprd.release_count at a time, so that
+ * releases keep pace with the link rather than a configured interval.
+ *
+ * With bprd.slot_length set, time is cut into slots aligned to CLOCK_REALTIME, so that nodes whose clocks are
+ * synchronized by NTP or PTP share slot boundaries.  Each slot opens with bprd.slot_guard of silence to absorb clock
+ * error, after which packets are released in a single burst.  Hellos are sent halfway through the slot and routes are
+ * updated three quarters through it, once neighbors' hellos have arrived, so that every slot runs release, hello and
+ * route update in that order and hellos do not collide with neighbors' bursts (\see scheduler_sleep).
+ * \{
+ */
+
+#include "scheduler.h"
+
+#include <errno.h>          /* for EINTR */
+#include <time.h>           /* for clock_nanosleep() */
+#include <unistd.h>         /* for usleep() */
+
+#include "backlogger.h"
+#include "bprd.h"
+#include "logger.h"
+#include "txq.h"
+#include "util.h"           /* for monotime_usec() */
+
+
+#define SCHEDULER_MIN_TICK 50000ULL     /**< Shortest time between ticks (nseconds). */
+#define SCHEDULER_NSEC_PER_SEC 1000000000ULL
+#define SCHEDULER_LAG_SHIFT 4           /**< Average lag is an EWMA with weight 1/2^SCHEDULER_LAG_SHIFT. */
+
+
+static uint32_t scheduler_lag_ewma;    /**< Average lag of ticks, scaled by 2^SCHEDULER_LAG_SHIFT (useconds). */
+static uint32_t scheduler_lag_worst;   /**< Largest lag of a tick (useconds). */
+static int64_t scheduler_txq_qlen = -1; /**< Packets last seen in the transmit queue, -1 if unknown. */
+static clockid_t scheduler_clock = CLOCK_MONOTONIC; /**< Clock ticks are scheduled on. */
+
+static const uint32_t scheduler_phase_quarter[] = {0, 2, 3}; /**< Start of each phase past the guard (quarters). */
+
+
+/**
+ * Read a clock.
+ *
+ * \param clock CLOCK_MONOTONIC or CLOCK_REALTIME.
+ *
+ * \return Current time (nseconds).
+ */
+static uint64_t scheduler_now(clockid_t clock) {
+
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * SCHEDULER_NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+ * Sleep until an absolute time of a clock.
+ *
+ * \param clock CLOCK_MONOTONIC or CLOCK_REALTIME.
+ * \param t Time to wake up at (nseconds).
+ */
+static void scheduler_sleep_until(clockid_t clock, uint64_t t) {
+
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(t / SCHEDULER_NSEC_PER_SEC);
+    ts.tv_nsec = (long)(t % SCHEDULER_NSEC_PER_SEC);
+    while (clock_nanosleep(clock, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+/**
+ * Sleep until a time of the realtime clock.
+ *
+ * The sleep is taken on the monotonic clock in steps of at most one slot, so that a step of the realtime clock delays
+ * the wake up by at most one slot.  A step back of more than a slot is reported rather than waited out.
+ *
+ * \param t Time to wake up at (nseconds of CLOCK_REALTIME).
+ *
+ * \retval 0 Once \a t is reached.
+ * \retval -1 If \a t moved more than a slot further away, the clock having been stepped back.
+ */
+static int scheduler_sleep_realtime(uint64_t t) {
+
+    uint64_t slot = (uint64_t)bprd.slot_length * 1000;
+    uint64_t now, left, step, expected = UINT64_MAX;
+    struct timespec ts;
+
+    while ((now = scheduler_now(CLOCK_REALTIME)) < t) {
+        left = t - now;
+        if (expected != UINT64_MAX && left > expected + slot) {
+            return -1;
+        }
+        step = (left < slot) ? left : slot;
+        ts.tv_sec = (time_t)(step / SCHEDULER_NSEC_PER_SEC);
+        ts.tv_nsec = (long)(step % SCHEDULER_NSEC_PER_SEC);
+        while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR);
+        expected = left - step;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Returns when a phase of the slot containing a time starts.
+ *
+ * \param t Time within the slot (nseconds of CLOCK_REALTIME).
+ * \param phase SCHEDULER_PHASE_RELEASE, SCHEDULER_PHASE_HELLO or SCHEDULER_PHASE_ROUTE.
+ *
+ * \return Start of the phase (nseconds of CLOCK_REALTIME).
+ */
+static uint64_t scheduler_phase(uint64_t t, int phase) {
+
+    uint64_t slot = (uint64_t)bprd.slot_length * 1000;
+    uint64_t guard = (uint64_t)bprd.slot_guard * 1000;
+
+    return t - t % slot + guard + (slot - guard) * scheduler_phase_quarter[phase] / 4;
+}
+
+
+/**
+ * Returns the release tick preceding the first release phase after a time, from which the release loop waits one
+ * slot.  The release phase of the time's own slot is not skipped if the time falls within its guard.
+ *
+ * \param t Time (nseconds of CLOCK_REALTIME).
+ *
+ * \return Release tick (nseconds of CLOCK_REALTIME).
+ */
+static uint64_t scheduler_align(uint64_t t) {
+
+    uint64_t phase = scheduler_phase(t, SCHEDULER_PHASE_RELEASE);
+
+    return (phase > t) ? phase - (uint64_t)bprd.slot_length * 1000 : phase;
+}
+
+
+/**
+ * Sleep for an interval, or in slotted mode until the given phase of the slot the interval ends in.  If that phase is
+ * already over, the phase of the following slot is waited for instead.
+ *
+ * Lets the hello writer and router threads keep their place within slots.
+ *
+ * \param interval Time to sleep, in slotted mode rounded to the phase of a slot (useconds).
+ * \param phase SCHEDULER_PHASE_HELLO or SCHEDULER_PHASE_ROUTE.
+ */
+void scheduler_sleep(uint32_t interval, int phase) {
+
+    uint64_t slot = (uint64_t)bprd.slot_length * 1000;
+    uint64_t now, t;
+
+    if (!bprd.slot_length) {
+        usleep(interval);
+        return;
+    }
+
+    do {
+        /* the phase of the slot the interval ends in, or of the next slot if the phase is already over */
+        now = scheduler_now(CLOCK_REALTIME);
+        if ((t = scheduler_phase(now + (uint64_t)interval * 1000, phase)) <= now) {
+            t = scheduler_phase(now + slot + (uint64_t)interval * 1000, phase);
+        }
+    } while (scheduler_sleep_realtime(t) < 0);
+}
+
+
+/**
+ * Account for how late a tick woke up.
+ *
+ * \param lag Time between the tick's scheduled and actual wake up (nseconds).
+ */
+static void scheduler_lag(uint64_t lag) {
+
+    uint32_t usec = (lag / 1000 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(lag / 1000);
+    uint32_t ewma = __atomic_load_n(&scheduler_lag_ewma, __ATOMIC_RELAXED);
+
+    /* ewma += usec - ewma/2^SHIFT, with ewma scaled by 2^SHIFT */
+    __atomic_store_n(&scheduler_lag_ewma, ewma - (ewma >> SCHEDULER_LAG_SHIFT) + usec, __ATOMIC_RELAXED);
+    if (usec > __atomic_load_n(&scheduler_lag_worst, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&scheduler_lag_worst, usec, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * Decide how many packets to release given the transmit queue's occupancy.
+ *
+ * \param releasing Whether the previous tick was releasing, updated to whether this one is.
+ *
+ * \return Maximum number of packets to release.
+ */
+static unsigned int scheduler_txq_count(int *releasing) {
+
+    int64_t qlen = txq_backlog();
+
+    __atomic_store_n(&scheduler_txq_qlen, qlen, __ATOMIC_RELAXED);
+    if (qlen < 0) {
+        /* fall back to the fixed release count rather than stall */
+        BPRD_LOG_DBG("Transmit queue could not be read");
+        return bprd.release_count;
+    }
+
+    if (qlen < bprd.txq_low) {
+        *releasing = 1;
+    } else if (qlen >= bprd.txq_high) {
+        *releasing = 0;
+    }
+    if (!*releasing) {
+        return 0;
+    }
+
+    return (bprd.txq_high - qlen < bprd.release_count) ? (unsigned int)(bprd.txq_high - qlen) : bprd.release_count;
+}
+
+
+/**
+ * Release packets and reconcile backlogs forever.  Only to be called from the releasing thread.
+ */
+void scheduler_run() {
+
+    uint64_t period, next, now, last;
+    uint64_t reconcile_next;
+    double tokens = 0.0;
+    unsigned int n;
+    int releasing = 1;
+
+    if (bprd.txq_high && txq_init(bprd.if_index) < 0) {
+        BPRD_LOG_ERR("Could not read the transmit queue of %s", bprd.if_name);
+    }
+
+    if (bprd.slot_length) {
+        scheduler_clock = CLOCK_REALTIME;
+        period = (uint64_t)bprd.slot_length * 1000;
+    } else if (bprd.release_rate) {
+        period = SCHEDULER_NSEC_PER_SEC / bprd.release_rate;
+        period = (period < SCHEDULER_MIN_TICK) ? SCHEDULER_MIN_TICK : period;
+    } else {
+        period = (uint64_t)bprd.release_interval * 1000;
+    }
+
+    last = next = now = scheduler_now(scheduler_clock);
+    if (bprd.slot_length) {
+        /* the release phase of the current slot, which may already be over */
+        next = scheduler_align(now);
+    }
+    reconcile_next = monotime_usec() + bprd.reconcile_interval;
+    while (1) {
+
+        /* wait for the next tick */
+        next += period;
+        if (!bprd.slot_length) {
+            scheduler_sleep_until(scheduler_clock, next);
+        } else if (scheduler_sleep_realtime(next) < 0) {
+            /* the realtime clock was stepped back, find our slot again */
+            next = scheduler_align(scheduler_now(scheduler_clock));
+            continue;
+        }
+        now = scheduler_now(scheduler_clock);
+        scheduler_lag((now > next) ? now - next : 0);
+        if (now > next && now - next > period) {
+            /* missed whole ticks (or the realtime clock was stepped forward), start over from now rather than catching
+             * up all at once */
+            next = bprd.slot_length ? scheduler_align(now) : now;
+        }
+
+        /* shed packets that have waited too long, then release packets */
+        backlogger_aqm();
+        if (bprd.release_rate) {
+            tokens += (double)(now - last) * bprd.release_rate / SCHEDULER_NSEC_PER_SEC;
+            tokens = (tokens > bprd.release_burst) ? bprd.release_burst : tokens;
+            if ((n = (unsigned int)tokens) > 0) {
+                tokens -= backlogger_packet_release(n);
+            }
+        } else if (bprd.txq_high) {
+            if ((n = scheduler_txq_count(&releasing)) > 0) {
+                backlogger_packet_release(n);
+            }
+        } else {
+            backlogger_packet_release(bprd.release_count);
+        }
+        last = now;
+
+        /* forget packets the kernel no longer holds */
+        if (bprd.reconcile_interval && monotime_usec() >= reconcile_next) {
+            backlogger_reconcile();
+            reconcile_next = monotime_usec() + bprd.reconcile_interval;
+        }
+    }
+}
+
+
+/**
+ * Returns the average time ticks woke up past their scheduled time.
+ *
+ * \return Average lag (useconds).
+ */
+uint32_t scheduler_lag_avg() {
+
+    return __atomic_load_n(&scheduler_lag_ewma, __ATOMIC_RELAXED) >> SCHEDULER_LAG_SHIFT;
+}
+
+
+/**
+ * Returns the largest time a tick woke up past its scheduled time.
+ *
+ * \return Largest lag (useconds).
+ */
+uint32_t scheduler_lag_max() {
+
+    return __atomic_load_n(&scheduler_lag_worst, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the number of packets last seen in the transmit queue, when releases follow it.
+ *
+ * \return Packets queued, or -1 if unknown.
+ */
+int64_t scheduler_txq() {
+
+    return __atomic_load_n(&scheduler_txq_qlen, __ATOMIC_RELAXED);
+}
+
+/** \} */
@@ -0,0 +1,27 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHEDULER_PHASE_RELEASE 0   /**< Packets are released at the start of each slot, after its guard. */
+#define SCHEDULER_PHASE_HELLO 1     /**< Hellos are sent halfway through the slot. */
+#define SCHEDULER_PHASE_ROUTE 2     /**< Routes are updated three quarters through the slot. */
+
+extern void scheduler_run();
+extern void scheduler_sleep(uint32_t interval, int phase);
+extern uint32_t scheduler_lag_avg();
+extern uint32_t scheduler_lag_max();
+extern int64_t scheduler_txq();
+
+#endif /* __SCHEDULER_H */
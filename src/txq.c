@@ -0,0 +1,101 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+/**
+ * \defgroup txq Transmit Queue
+ * This module reads how many packets wait in the root qdisc of an interface, via netlink tc statistics.
+ * \{
+ */
+
+#include "txq.h"
+
+#include <linux/pkt_sched.h>            /* for TC_H_ROOT */
+#include <netlink/cache.h>              /* for nl_cache_refill(), nl_cache_free() */
+#include <netlink/netlink.h>            /* for nl_connect(), nl_close() */
+#include <netlink/route/qdisc.h>        /* for rtnl_qdisc_alloc_cache(), rtnl_qdisc_get_by_parent() */
+#include <netlink/route/tc.h>           /* for rtnl_tc_get_stat(), RTNL_TC_QLEN */
+#include <netlink/socket.h>             /* for nl_sock, nl_socket_alloc(), nl_socket_free() */
+
+
+static struct nl_sock *txq_nlsk = NULL;     /**< Netlink route socket, owned by the releasing thread. */
+static struct nl_cache *txq_cache = NULL;   /**< Cache of qdiscs, refilled on every read. */
+static unsigned int txq_if_index;           /**< Interface whose root qdisc is read. */
+
+
+/**
+ * Initialize reading the transmit queue of an interface.
+ *
+ * \param if_index The interface whose root qdisc to read.
+ *
+ * \retval 0 On success.
+ * \retval -1 On error.
+ */
+int txq_init(unsigned int if_index) {
+
+    txq_if_index = if_index;
+
+    if ((txq_nlsk = nl_socket_alloc()) == NULL) {
+        return -1;
+    }
+
+    if (nl_connect(txq_nlsk, NETLINK_ROUTE) < 0) {
+        return -1;
+    }
+
+    if (rtnl_qdisc_alloc_cache(txq_nlsk, &txq_cache) < 0) {
+        return -1;
+    }
+
+    return (txq_backlog() < 0) ? -1 : 0;
+}
+
+
+/**
+ * Returns the number of packets queued in the interface's root qdisc.  Classful and multiqueue root qdiscs report the
+ * packets of their children.  Packets already handed to the driver are not counted.
+ *
+ * \return Packets queued, or -1 on error.
+ */
+int64_t txq_backlog() {
+
+    struct rtnl_qdisc *qdisc;
+    int64_t qlen;
+
+    if (nl_cache_refill(txq_nlsk, txq_cache) < 0) {
+        return -1;
+    }
+
+    if ((qdisc = rtnl_qdisc_get_by_parent(txq_cache, (int)txq_if_index, TC_H_ROOT)) == NULL) {
+        return -1;
+    }
+
+    qlen = (int64_t)rtnl_tc_get_stat(TC_CAST(qdisc), RTNL_TC_QLEN);
+    rtnl_qdisc_put(qdisc);
+
+    return qlen;
+}
+
+
+/**
+ * Cleanup reading the transmit queue.
+ */
+void txq_cleanup() {
+
+    if (txq_cache != NULL) {
+        nl_cache_free(txq_cache);
+    }
+    if (txq_nlsk != NULL) {
+        nl_close(txq_nlsk);
+        nl_socket_free(txq_nlsk);
+    }
+}
+
+/** \} */
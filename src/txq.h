@@ -0,0 +1,21 @@
+/**
+ * The BackPressure Routing Daemon (bprd).
+ *
+ * Copyright (c) 2012 Jeffrey Wildman <jeffrey.wildman@gmail.com>
+ * Copyright (c) 2012 Bradford Boyle <bradford.d.boyle@gmail.com>
+ *
+ * bprd is released under the MIT License.  You should have received
+ * a copy of the MIT License with this program.  If not, see
+ * <http://opensource.org/licenses/MIT>.
+ */
+
+#ifndef __TXQ_H
+#define __TXQ_H
+
+#include <stdint.h>
+
+extern int txq_init(unsigned int if_index);
+extern int64_t txq_backlog();
+extern void txq_cleanup();
+
+#endif /* __TXQ_H */
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>           /* for clock_gettime() */
 
 #include "bprd.h"
 
@@ -191,3 +192,12 @@ void print_args(int argc, char **argv) {
     }
 }
 
+
+/* current time of the monotonic clock (useconds) */
+uint64_t monotime_usec() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -13,6 +13,7 @@
 #define __UTIL_H
 
 #include <arpa/inet.h>
+#include <stdint.h>
 
 #define BIT(x) (1ULL<<(x))
 
@@ -28,4 +29,6 @@ extern void print_args(int argc, char **argv);
 
 extern void print_addrs();
 
+extern uint64_t monotime_usec();
+
 #endif /* __UTIL_H */